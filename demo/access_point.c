@@ -13,32 +13,56 @@
 #include "uart.h"
 #include "timers.h"
 #include "radio.h"
+#include "packets.h"
+#include "slot_monitor.h"
+#include "slot_schedule.h"
+#include "flow_control.h"
 
 uint8_t tx_buffer[PACKET_LEN+1];
 
 uint8_t print_buffer[200];
 
-typedef struct
-{
-  uint8_t length;
-  uint8_t source;
-  uint8_t type;
-  uint8_t flags;
-} packet_header_t;
+// Answers to time transfer requests are sent from the CCR4 ISR, a fixed time 
+// after the request came in, so a busy main loop can't hold them up
+#define TIME_RESPONSE_CCR (4)
+uint8_t time_buffer[sizeof(packet_header_t) + sizeof(packet_time_response_t)];
 
-typedef struct
-{
-  uint8_t samples[ADC_MAX_SAMPLES];
-} packet_data_t;
+// Superframes between sync messages, adjusted to the measured timing error
+uint8_t beacon_interval = 1;
+uint8_t superframe_count = 0;
 
-typedef struct
-{
-  uint8_t rssi;
-  uint8_t lqi_crcok;
-} packet_footer_t;
+// Set when a sync message is loaded in the radio, waiting for CCR0
+uint8_t sync_ready = 0;
+
+// Devices asked (by the host) to capture a burst, one bit per device
+volatile uint8_t burst_request = 0;
+
+// Sent back to the host for a command that can't be carried out. A packet
+// header with the command as its payload
+#define NAK_FRAME_SIZE ( sizeof(packet_header_t) + 1 )
+uint8_t nak_buffer[NAK_FRAME_SIZE];
+
+// Time transfer request waiting for an answer (source 0 if none)
+volatile uint8_t time_request_source = 0;
+uint8_t time_request_sequence;
+uint16_t time_request_time;
+uint8_t time_request_fraction;
+
+// Device the answer on the air is for, 0 if none
+uint8_t time_response_source = 0;
 
+// Sequence and send time of the last answer to each device, sent with the next
+uint8_t time_response_sequence[MAX_DEVICES];
+uint16_t time_response_time[MAX_DEVICES];
+uint8_t time_response_fraction[MAX_DEVICES];
+
+uint8_t prepare_sync_message();
 uint8_t send_sync_message();
 uint8_t process_rx( uint8_t*, uint8_t );
+uint8_t process_uart_rx( uint8_t );
+uint8_t frame_priority( uint8_t );
+uint8_t send_time_response();
+uint8_t command_nak( uint8_t );
 
 int main( void )
 {
@@ -51,9 +75,9 @@ int main( void )
   header = (packet_header_t*)tx_buffer;
   
   // Initialize Tx Buffer
-  header->length = sizeof(packet_header_t) - 1;
+  header->length = sizeof(packet_header_t) + sizeof(packet_sync_t) - 1;
   header->source = DEVICE_ADDRESS;
-  header->type = 0x66; // Sync message
+  header->type = SYNC_PACKET;
   header->flags = 0xAA;
   
   // Make sure processor is running at 12MHz
@@ -61,20 +85,44 @@ int main( void )
   
   // Initialize UART for communications at 115200baud
   setup_uart();
+  register_uart_rx_callback( process_uart_rx );
    
   // Initialize LEDs
   setup_leds();
   
+  // A bad SLOT_SCHEDULE would make the slot statistics meaningless (or divide
+  // by a zero period), so don't start the network. All LEDs on, sleep for good
+  if( !slot_schedule_valid() )
+  {
+    led1_on();
+    led2_on();
+    led3_on();
+    __bis_SR_register( LPM4_bits );
+  }
+  
   // Initialize timer
   set_ccr( 0, TIMER_LIMIT );
   setup_timer_a(MODE_UP);
   
-  // Send sync message
+  // Load the sync message ahead of time, send it right when the timer wraps
+  register_timer_callback( prepare_sync_message, 2 );
+  set_ccr( 2, TIMER_LIMIT - TX_PREPARE_LEAD );
   register_timer_callback( send_sync_message, 0 );
+  
+  // Classify every slot and report slot statistics once per superframe
+  setup_slot_monitor( 1 );
+  
+  register_timer_callback( send_time_response, TIME_RESPONSE_CCR );
 
   // Initialize radio and enable receive callback function
   setup_radio( process_rx );
   
+  // Ignore other networks and anything longer than our own packets
+  radio_set_network( NETWORK_ID, MAX_PACKET_LENGTH );
+  
+  // Sub-tick timestamps for time transfers
+  radio_fine_timestamps( FINE_TIMESTAMPS );
+  
   // Enable interrupts, otherwise nothing will work
   eint();
    
@@ -83,20 +131,83 @@ int main( void )
     // Enter sleep mode
     __bis_SR_register( LPM0_bits + GIE );
     __no_operation();
-        
+    
+    flow_control_send();
   }
   
   return 0;
 }
 
+/*******************************************************************************
+ * @fn     uint8_t prepare_sync_message()
+ * @brief  Called TX_PREPARE_LEAD ticks before the start of every superframe.
+ *         Loads a sync message every beacon_interval superframes. The interval
+ *         sent with it is shortened if devices drifted too far
+ * ****************************************************************************/
+uint8_t prepare_sync_message()
+{
+  packet_sync_t* sync;
+  uint8_t sync_error;
+  
+  sync = (packet_sync_t*)(tx_buffer + sizeof(packet_header_t));
+  
+  superframe_count++;
+  
+  // Devices only listen when the last sync message told them to, an earlier
+  // one wouldn't be heard
+  if( superframe_count < beacon_interval )
+  {
+    return 0;
+  }
+  
+  sync_error = slot_monitor_sync_error();
+  
+  if( sync_error > SYNC_ERROR_HIGH )
+  {
+    // Devices are drifting apart, resync more often from now on
+    if( beacon_interval > 1 )
+    {
+      beacon_interval >>= 1;
+    }
+  }
+  else if( ( sync_error <= SYNC_ERROR_LOW ) && 
+            ( beacon_interval < MAX_BEACON_INTERVAL ) )
+  {
+    beacon_interval <<= 1;
+  }
+  
+  superframe_count = 0;
+  
+  // Let devices know when to listen for the next one
+  sync->interval = beacon_interval;
+  
+  // Let every device know how far off its slot was after the last sync message
+  slot_monitor_offsets( sync->slot_offset );
+  
+  sync->burst_request = burst_request;
+  burst_request = 0;
+  
+  // Sent by send_sync_message()
+  radio_tx_prepare( tx_buffer, sizeof(packet_header_t) + sizeof(packet_sync_t) );
+  sync_ready = 1;
+  
+  return 0;
+}
+
 /*******************************************************************************
  * @fn     uint8_t send_sync_message()
- * @brief  TODO
+ * @brief  Called at the start of every superframe. Sends the sync message 
+ *         loaded by prepare_sync_message(), if any
  * ****************************************************************************/
 uint8_t send_sync_message()
 {
-  // Send sync message
-  radio_tx( tx_buffer, sizeof(packet_header_t) );
+  if( !sync_ready )
+  {
+    return 0;
+  }
+  
+  radio_tx_start();
+  sync_ready = 0;
   led2_toggle();
   
   return 1;
@@ -109,6 +220,7 @@ uint8_t send_sync_message()
 uint8_t process_rx( uint8_t* buffer, uint8_t size )
 {
   packet_header_t* header;
+  uint16_t response_time;
   static uint8_t counter = 0;
   header = (packet_header_t*)(buffer);
 
@@ -116,8 +228,34 @@ uint8_t process_rx( uint8_t* buffer, uint8_t size )
   // Add one to account for the byte with the packet length
   //footer = (packet_footer_t*)(buffer + header->length + 1 );
 
+  // Relayed copies arrive late on purpose, only time direct transmissions
+  if( ( SAMPLES_PACKET == header->type ) && !( header->flags & REPEATER_FLAG ) )
+  {
+    slot_monitor_frame( header->source, radio_sync_time() );
+  }
+  
+  // Answered by send_time_response(), once this ISR is done with the radio
+  if( ( TIME_REQUEST_PACKET == header->type ) && 
+      !( header->flags & REPEATER_FLAG ) &&
+      ( header->source > 0 ) && ( header->source <= MAX_DEVICES ) )
+  {
+    time_request_sequence = ((packet_time_request_t*)
+                              (buffer + sizeof(packet_header_t)))->sequence;
+    time_request_time = radio_sync_time();
+    time_request_fraction = radio_sync_fraction();
+    time_request_source = header->source;
+    
+    response_time = timer_now() + TIME_RESPONSE_DELAY;
+    if( response_time > TIMER_LIMIT )
+    {
+      response_time -= TIMER_LIMIT + 1;
+    }
+    set_ccr( TIME_RESPONSE_CCR, response_time );
+  }
+
   //uart_write( , 1 );
-  uart_write_escaped( buffer, header->length + 1 );  
+  flow_control_write( buffer, header->length + 1, 
+                                              frame_priority( header->type ) );
   
   // Erase buffer just for fun
   memset( buffer, 0x00, size );
@@ -126,3 +264,147 @@ uint8_t process_rx( uint8_t* buffer, uint8_t size )
   return 1;
 }
 
+/*******************************************************************************
+ * @fn     uint8_t send_time_response()
+ * @brief  CCR4 callback, answers the last time transfer request. The time 
+ *         this answer goes out is only known once it has been sent, so it 
+ *         goes with the next answer to the same device. Called again every 
+ *         tick until then to pick it up. Answers wait for a loaded sync 
+ *         message to go out first
+ * ****************************************************************************/
+uint8_t send_time_response()
+{
+  packet_header_t* header;
+  packet_time_response_t* response;
+  uint8_t device;
+  
+  if( time_response_source )
+  {
+    // A loaded sync message also counts as transmitting, but the last frame
+    // sent is still the answer until the sync message goes out
+    if( radio_transmitting() && !sync_ready )
+    {
+      increment_ccr( TIME_RESPONSE_CCR, 1 );
+      return 0;
+    }
+    
+    device = time_response_source - 1;
+    time_response_time[device] = radio_tx_sync_time();
+    time_response_fraction[device] = radio_tx_sync_fraction();
+    time_response_source = 0;
+  }
+  
+  // Another request may have come in meanwhile
+  if( !time_request_source )
+  {
+    clear_ccr( TIME_RESPONSE_CCR );
+    return 0;
+  }
+  
+  // Don't overwrite the sync message waiting in the TX FIFO, or cut a frame
+  // short. Try again next tick
+  if( sync_ready || radio_transmitting() )
+  {
+    increment_ccr( TIME_RESPONSE_CCR, 1 );
+    return 0;
+  }
+  
+  header = (packet_header_t*)time_buffer;
+  response = (packet_time_response_t*)(time_buffer + sizeof(packet_header_t));
+  
+  header->length = sizeof(packet_header_t) + sizeof(packet_time_response_t) - 1;
+  header->source = DEVICE_ADDRESS;
+  header->type = TIME_RESPONSE_PACKET;
+  header->flags = 0x00;
+  
+  device = time_request_source - 1;
+  
+  response->destination = time_request_source;
+  response->sequence = time_request_sequence;
+  response->request_time = time_request_time;
+  response->request_fraction = time_request_fraction;
+  response->last_sequence = time_response_sequence[device];
+  response->last_response_time = time_response_time[device];
+  response->last_response_fraction = time_response_fraction[device];
+  
+  time_response_sequence[device] = response->sequence;
+  time_response_source = time_request_source;
+  time_request_source = 0;
+  
+  radio_tx( time_buffer, sizeof(time_buffer) );
+  increment_ccr( TIME_RESPONSE_CCR, 1 );
+  
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn     uint8_t process_uart_rx( uint8_t character )
+ * @brief  callback function called when a command comes in from the host
+ * ****************************************************************************/
+uint8_t process_uart_rx( uint8_t character )
+{
+  uint8_t address;
+  
+  if( CREDIT_COMMAND == ( character & COMMAND_MASK ) )
+  {
+    return flow_control_credit( character & ~COMMAND_MASK );
+  }
+  
+  if( FRAMING_COMMAND == ( character & COMMAND_MASK ) )
+  {
+    if( !uart_set_framing( character & ~COMMAND_MASK ) )
+    {
+      return command_nak( character );
+    }
+    return 0;
+  }
+  
+  if( BURST_COMMAND == ( character & COMMAND_MASK ) )
+  {
+    // Sent with the next sync message
+    address = character & ~COMMAND_MASK;
+    if( ( address > 0 ) && ( address <= MAX_DEVICES ) )
+    {
+      burst_request |= ( 1 << (address - 1) );
+    }
+  }
+  
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn     uint8_t command_nak( uint8_t command )
+ * @brief  Tell the host [command] was rejected. Returns 1 so main wakes up to
+ *         send it
+ * ****************************************************************************/
+uint8_t command_nak( uint8_t command )
+{
+  nak_buffer[0] = sizeof(nak_buffer) - 1; // Length doesn't count itself
+  nak_buffer[1] = DEVICE_ADDRESS;
+  nak_buffer[2] = COMMAND_NAK_PACKET;
+  nak_buffer[3] = 0x00; // Flags
+  nak_buffer[sizeof(packet_header_t)] = command;
+  
+  flow_control_write( nak_buffer, sizeof(nak_buffer), FLOW_PRIORITY_HIGH );
+  
+  return 1;
+}
+
+/*******************************************************************************
+ * @fn     uint8_t frame_priority( uint8_t type )
+ * @brief  Priority of a received frame on its way to the host
+ * ****************************************************************************/
+uint8_t frame_priority( uint8_t type )
+{
+  switch( type )
+  {
+    case BURST_PACKET:
+      return FLOW_PRIORITY_LOW;
+    
+    case TIME_REQUEST_PACKET:
+      return FLOW_PRIORITY_HIGH;
+    
+    default:
+      return FLOW_PRIORITY_NORMAL;
+  }
+}
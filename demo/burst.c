@@ -0,0 +1,143 @@
+/** @file burst.c
+*
+* @brief End device burst capture. Every ADC sample (at ADC_RATE) goes into a
+*         ring buffer. When a burst is triggered, recording continues until
+*         the samples after the trigger fill the part of the ring not holding
+*         BURST_PRE_CHUNKS chunks from before it. The ring is then frozen and
+*         uploaded a chunk at a time in the device's spare slot, after which
+*         recording starts again.
+*
+* @author Alvaro Prieto
+*/
+#include "burst.h"
+
+#define BURST_SAMPLES (BURST_CHUNKS * BURST_CHUNK_SAMPLES)
+#define BURST_POST_SAMPLES ((BURST_CHUNKS - BURST_PRE_CHUNKS) * BURST_CHUNK_SAMPLES)
+
+// Burst states
+#define BURST_RECORDING (0) // Waiting for a trigger
+#define BURST_TRIGGERED (1) // Recording samples after the trigger
+#define BURST_UPLOADING (2) // Ring frozen, sending chunks
+
+static uint8_t burst_ring[BURST_SAMPLES];
+static uint16_t burst_head = 0; // Next sample to write, oldest when frozen
+static uint16_t burst_count = 0; // Samples left to record (or in ring so far)
+
+static volatile uint8_t burst_state = BURST_RECORDING;
+static uint8_t burst_id = 0;
+static uint8_t next_chunk = 0;
+
+/*******************************************************************************
+ * @fn     uint8_t burst_sample( uint8_t sample )
+ * @brief  Add a sample to the ring. Called from the ADC ISR at ADC_RATE.
+ *         Returns 1 when this sample completes a burst
+ * ****************************************************************************/
+uint8_t burst_sample( uint8_t sample )
+{
+  if( BURST_UPLOADING == burst_state )
+  {
+    return 0;
+  }
+  
+  burst_ring[burst_head] = sample;
+  burst_head++;
+  if( BURST_SAMPLES == burst_head )
+  {
+    burst_head = 0;
+  }
+  
+  if( BURST_RECORDING == burst_state )
+  {
+    // Keep track of how full the ring is, so the pre-trigger part is valid
+    if( burst_count < BURST_SAMPLES )
+    {
+      burst_count++;
+    }
+  }
+  else if( --burst_count == 0 )
+  {
+    burst_state = BURST_UPLOADING;
+    next_chunk = 0;
+    return 1;
+  }
+  
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn     uint8_t burst_trigger( void )
+ * @brief  Capture a burst around this moment. Ignored while a burst is being
+ *         captured or uploaded, or before the pre-trigger part has filled up.
+ *         Returns 1 if a burst was started
+ * ****************************************************************************/
+uint8_t burst_trigger( void )
+{
+  if( ( BURST_RECORDING != burst_state ) || 
+      ( burst_count < ( BURST_SAMPLES - BURST_POST_SAMPLES ) ) )
+  {
+    return 0;
+  }
+  
+  burst_count = BURST_POST_SAMPLES;
+  burst_state = BURST_TRIGGERED;
+  
+  return 1;
+}
+
+/*******************************************************************************
+ * @fn     uint8_t burst_pending( void )
+ * @brief  Returns 1 if there are burst chunks waiting to be sent
+ * ****************************************************************************/
+uint8_t burst_pending( void )
+{
+  return ( BURST_UPLOADING == burst_state );
+}
+
+/*******************************************************************************
+ * @fn     uint8_t burst_chunk( packet_burst_t* chunk )
+ * @brief  Fill in the next chunk to send. Returns 0 if there is nothing to send
+ * ****************************************************************************/
+uint8_t burst_chunk( packet_burst_t* chunk )
+{
+  uint16_t index;
+  uint8_t sample;
+  
+  if( BURST_UPLOADING != burst_state )
+  {
+    return 0;
+  }
+  
+  chunk->burst = burst_id;
+  chunk->chunk = next_chunk;
+  chunk->pre_chunks = BURST_PRE_CHUNKS;
+  chunk->total_chunks = BURST_CHUNKS;
+  chunk->sample_rate = ADC_RATE;
+  
+  // Oldest sample is where the next one would have been written
+  index = burst_head + next_chunk * BURST_CHUNK_SAMPLES;
+  if( index >= BURST_SAMPLES )
+  {
+    index -= BURST_SAMPLES;
+  }
+  
+  for( sample = 0; sample < BURST_CHUNK_SAMPLES; sample++ )
+  {
+    chunk->samples[sample] = burst_ring[index];
+    index++;
+    if( BURST_SAMPLES == index )
+    {
+      index = 0;
+    }
+  }
+  
+  next_chunk++;
+  if( BURST_CHUNKS == next_chunk )
+  {
+    // Done, start over. The pre-trigger part has to fill up again
+    burst_id++;
+    burst_count = 0;
+    burst_state = BURST_RECORDING;
+  }
+  
+  return 1;
+}
@@ -0,0 +1,18 @@
+/** @file burst.h
+*
+* @brief End device burst capture at the full ADC rate
+*
+* @author Alvaro Prieto
+*/
+#ifndef _BURST_H
+#define _BURST_H
+
+#include "settings.h"
+#include "packets.h"
+
+uint8_t burst_sample( uint8_t );
+uint8_t burst_trigger( void );
+uint8_t burst_pending( void );
+uint8_t burst_chunk( packet_burst_t* );
+
+#endif /* _BURST_H */
@@ -1,10 +1,16 @@
 DEMOAP_OBJS += \
 	$(LIB_OBJS) \
-	demo/access_point.o
+	demo/access_point.o \
+	demo/slot_monitor.o \
+	demo/slot_schedule.o \
+	demo/flow_control.o
 
 DEMOED_OBJS += \
 	$(LIB_OBJS) \
-	demo/end_device.o
+	demo/end_device.o \
+	demo/slot_schedule.o \
+	demo/burst.o \
+	demo/time_transfer.o
 
 DEMORE_OBJS += \
 	$(LIB_OBJS) \
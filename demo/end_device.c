@@ -11,35 +11,30 @@
 #include "oscillator.h"
 #include "uart.h"
 #include "timers.h"
+#include "sample_timer.h"
 #include "radio.h"
+#include "stack.h"
+#include "intrinsics.h"
 #include "settings.h"
+#include "packets.h"
+#include "burst.h"
+#include "time_transfer.h"
+#include "slot_schedule.h"
 
-uint8_t tx_buffer[PACKET_LEN+1];
+#if ( ( ( TIMER_LIMIT + 1L ) * ADC_RATE ) % SAMPLE_TIMER_CLOCK ) != 0
+#error "A superframe must be a whole number of ADC sample periods"
+#endif
 
-uint8_t print_buffer[200];
-
-typedef struct
-{
-  uint8_t length;
-  uint8_t source;
-  uint8_t type;
-  uint8_t flags;
-} packet_header_t;
-
-typedef struct
-{
-  uint8_t samples[ADC_MAX_SAMPLES];
-} packet_data_t;
+uint8_t tx_buffer[MAX_PACKET_LENGTH+1];
 
-typedef struct
-{
-  uint8_t rssi;
-  uint8_t lqi_crcok;
-} packet_footer_t;
+uint8_t print_buffer[200];
 
 uint8_t start_sample();
 uint8_t process_rx( uint8_t*, uint8_t );
 uint8_t send_samples();
+uint8_t beacon_window();
+uint8_t beacon_window_check();
+uint16_t own_slot_time();
 void setup_adc();
 
 
@@ -47,6 +42,46 @@ uint8_t sample_buffer[ADC_MAX_SAMPLES * 2];
 uint8_t buffer_index = 0;
 uint8_t current_buffer = 0;
 
+// Sum of ADC samples for the next (averaged) streamed sample
+uint16_t decimation_sum = 0;
+uint8_t decimation_count = 0;
+uint8_t last_sample = 0;
+
+// Sum of averaged samples for the next sample sent, one per own_slot.period
+uint16_t period_sum = 0;
+uint8_t period_count = 0;
+
+// Set while CCR2 is waiting for the spare slot (bursts and time transfers)
+uint8_t in_spare_slot = 0;
+
+// Set while a frame is loaded in the radio, waiting for its slot to start
+uint8_t tx_ready = 0;
+
+// Worst-case stack use, sent with time transfer requests. Scanning the painted
+// stack takes too long for an ISR, so main does it when stack_measure is set
+volatile uint16_t stack_used = 0;
+volatile uint8_t stack_measure = 0;
+
+// Start of the slot after the current one
+uint16_t next_slot;
+
+// This device's entry in slot_schedule
+slot_schedule_t own_slot = { 0, 1, 0 };
+
+// Slot timing correction accumulated from the AP's measurements, and the
+// first slot of the superframe with it applied
+int16_t slot_offset = 0;
+uint16_t slot_time;
+
+// Time transfer correction already taken out of slot_offset
+int16_t applied_correction = 0;
+
+// Superframes left until the next sync message
+uint8_t superframes_to_beacon = 0;
+
+// Sync messages missed in a row. Listen continuously after too many
+uint8_t missed_beacons = MAX_MISSED_BEACONS;
+
 int main( void )
 {
   
@@ -55,12 +90,15 @@ int main( void )
   // Stop watchdog timer to prevent time out reset
   WDTCTL = WDTPW + WDTHOLD;
   
+  // Fill unused stack so worst-case use can be measured with stack_max_used()
+  stack_paint();
+  
   header = (packet_header_t*)tx_buffer;
   
   // Initialize Tx Buffer
   header->length = sizeof(packet_header_t) + sizeof(packet_data_t) - 1;
   header->source = DEVICE_ADDRESS;
-  header->type = 0xAA; // Samples
+  header->type = SAMPLES_PACKET;
   header->flags = 0x00;
   
   // Make sure processor is running at 12MHz
@@ -74,20 +112,55 @@ int main( void )
   // Initialize LEDs
   setup_leds();
   
+  // A bad SLOT_SCHEDULE would put devices on top of each other (or divide
+  // by a zero period), so don't join at all. All LEDs on, sleep for good
+  if( !slot_schedule_valid() )
+  {
+    led1_on();
+    led2_on();
+    led3_on();
+    __bis_SR_register( LPM4_bits );
+  }
+  
+  if( (DEVICE_ADDRESS > 0) && (DEVICE_ADDRESS <= MAX_DEVICES) )
+  {
+    own_slot = slot_schedule[DEVICE_ADDRESS - 1];
+  }
+  slot_time = own_slot_time();
+  
   // Initialize timer
   set_ccr( 0, TIMER_LIMIT );
   setup_timer_a(MODE_UP);
   
-  // Send sync message
-  register_timer_callback( start_sample, 1 );
-  set_ccr( 1, SAMPLE_RATE );
+  // Sampling runs on its own timer, only ever nudged by sync messages
+  setup_sample_timer( ADC_RATE, start_sample );
+  
+  // Sampling may interrupt the radio ISR so its timing doesn't depend on it
+  set_preemptive_ccr( PREEMPTION_OTHER_TIMER );
   
+  // Frames are loaded TX_PREPARE_LEAD ticks before the slot starts
   register_timer_callback( send_samples, 2 );
-  set_ccr( 2, (( REST_TIME/2) + MINOR_CYCLE * (DEVICE_ADDRESS - 1) ) );
+  set_ccr( 2, slot_time - TX_PREPARE_LEAD );
+  
+  // Start listening shortly before a sync message is expected. CCR3 is used
+  // by the radio to timestamp sync words
+  register_timer_callback( beacon_window, 1 );
+  set_ccr( 1, TIMER_LIMIT - BEACON_GUARD );
+  
+  // Find out if the radio closed the window without hearing anything
+  register_timer_callback( beacon_window_check, 4 );
+  set_ccr( 4, BEACON_WINDOW - BEACON_GUARD + BEACON_CHECK_DELAY );
     
   // Initialize radio and enable receive callback function
   setup_radio( process_rx );
   
+  // Ignore other networks and anything longer than our own packets
+  radio_set_network( NETWORK_ID, MAX_PACKET_LENGTH );
+  
+  // No sub-tick timestamps, they need TA1 (the sample timer) and SMCLK in 
+  // LPM3. The AP's side of every time transfer still gets them
+  radio_fine_timestamps( 0 );
+  
   // Lower power so relays can be used
   WriteSinglePATable(0x0D);
   
@@ -103,6 +176,12 @@ int main( void )
     __bis_SR_register( LPM3_bits + GIE );
     __no_operation();
     //led2_toggle();
+    
+    if( stack_measure )
+    {
+      stack_measure = 0;
+      stack_used = stack_max_used();
+    }
   }
   
   return 0;
@@ -114,17 +193,8 @@ int main( void )
  * ****************************************************************************/
 uint8_t start_sample()
 { 
-  //TODO Actually use timer functions later
-  // Direct access to timer registers for faster development
-  
   // Queue ADC conversion
 	ADC12CTL0 |= ADC12SC;
-  
-  TA0CCR1 += SAMPLE_RATE;
-  if (TA0CCR1 > TIMER_LIMIT)
-  {
-    TA0CCR1 -= TIMER_LIMIT;
-  }
     
   led1_on();
   
@@ -138,14 +208,94 @@ uint8_t start_sample()
 uint8_t process_rx( uint8_t* buffer, uint8_t size )
 {
   packet_header_t* header;
+  packet_sync_t* sync;
+  packet_time_response_t* response;
+  uint16_t interrupt_state;
+  uint16_t restart;
+  uint16_t now;
+  int16_t correction;
   header = (packet_header_t*)buffer;
   
-  if( header->type == 0x66 )
+  if( header->type == SYNC_PACKET )
   {
-    // TODO: save current timer value here
-    clear_timer();
-    TA0CCR1 = SAMPLE_RATE;
+    // Ends the beacon window
+    radio_window_accept();
+    
+    // Timer restart and sample timer reading have to happen together
+    interrupt_state = __get_interrupt_state();
+    dint();
+    
+    // The AP started sending at 0, so its sync word went out around
+    // SLOT_SYNC_DELAY (corrected by the two-way time transfer). Add the time
+    // since this device captured it
+    now = timer_now();
+    restart = SLOT_SYNC_DELAY + time_transfer_correction() + 
+                                              ( now - radio_sync_time() );
+    if( now < radio_sync_time() )
+    {
+      restart += TIMER_LIMIT + 1;
+    }
+    set_timer( restart );
+    
+    // Samples keep their own clock, it is only slowly moved to line up with 
+    // the restarted timer
+    sample_timer_align( sample_timer_now() - restart );
+    
+    __set_interrupt_state( interrupt_state );
     led1_off();
+    
+    // Move the slot by however far off the AP saw it last superframe
+    sync = (packet_sync_t*)(buffer + sizeof(packet_header_t));
+    if( (DEVICE_ADDRESS > 0) && (DEVICE_ADDRESS <= MAX_DEVICES) )
+    {
+      slot_offset += sync->slot_offset[DEVICE_ADDRESS - 1];
+    }
+    
+    // The time transfer owns the timer offset. A change in its correction
+    // already moves the slot, so it comes out of slot_offset
+    correction = time_transfer_correction();
+    slot_offset -= correction - applied_correction;
+    applied_correction = correction;
+    
+    if( slot_offset > MAX_SLOT_OFFSET )
+    {
+      slot_offset = MAX_SLOT_OFFSET;
+    }
+    else if( slot_offset < -MAX_SLOT_OFFSET )
+    {
+      slot_offset = -MAX_SLOT_OFFSET;
+    }
+    
+    slot_time = own_slot_time();
+    TA0CCR2 = slot_time - TX_PREPARE_LEAD;
+    in_spare_slot = 0;
+    
+    if( (DEVICE_ADDRESS > 0) && (DEVICE_ADDRESS <= MAX_DEVICES) && 
+        ( sync->burst_request & ( 1 << (DEVICE_ADDRESS - 1) ) ) )
+    {
+      burst_trigger();
+    }
+    
+    // Nothing else to listen for until the next sync message
+    superframes_to_beacon = sync->interval;
+    missed_beacons = 0;
+    if( superframes_to_beacon )
+    {
+      radio_listen( 0 );
+    }
+  }
+  
+  if( ( header->type == TIME_RESPONSE_PACKET ) && 
+      !( header->flags & REPEATER_FLAG ) )
+  {
+    response = (packet_time_response_t*)(buffer + sizeof(packet_header_t));
+    if( DEVICE_ADDRESS == response->destination )
+    {
+      radio_window_accept();
+      time_transfer_response( response, radio_tx_sync_time(), 
+                                radio_tx_sync_fraction(), radio_sync_time(), 
+                                                      radio_sync_fraction() );
+    }
   }
   
   packet_footer_t* footer;
@@ -162,34 +312,170 @@ uint8_t process_rx( uint8_t* buffer, uint8_t size )
 
 /*******************************************************************************
  * @fn     uint8_t send_samples()
- * @brief  TODO
+ * @brief  Called TX_PREPARE_LEAD ticks before the device's slot, and before 
+ *         its spare slot while a burst is being uploaded or a time transfer 
+ *         is due, to load the radio. Called again right at the start of the
+ *         slot to send
  * ****************************************************************************/
 uint8_t send_samples()
 { 
+  packet_header_t* header;
   packet_data_t* data;
+  packet_burst_t* burst;
+  packet_time_request_t* request;
+  uint16_t slot;
+  
+  if( tx_ready )
+  {
+    // Frame was loaded TX_PREPARE_LEAD ticks ago, send it right on time
+    radio_tx_start();
+    tx_ready = 0;
+    TA0CCR2 = next_slot - TX_PREPARE_LEAD;
+    
+    return 0;
+  }
   
   led2_toggle();
   
-  if( TA0CCR2 > MAJOR_CYCLE_LOOP )
+  header = (packet_header_t*)tx_buffer;
+  slot = TA0CCR2 + TX_PREPARE_LEAD;
+  
+  if( in_spare_slot )
+  {
+    // Back to the regular slot, own_slot.period major cycles later
+    in_spare_slot = 0;
+    next_slot = slot + ( MAJOR_CYCLE * own_slot.period - BURST_SLOT_OFFSET );
+    
+    burst = (packet_burst_t*)(tx_buffer + sizeof(packet_header_t));
+    request = (packet_time_request_t*)(tx_buffer + sizeof(packet_header_t));
+    if( burst_chunk( burst ) )
+    {
+      header->type = BURST_PACKET;
+      header->length = sizeof(packet_header_t) + sizeof(packet_burst_t) - 1;
+      radio_tx_prepare( tx_buffer, 
+                            sizeof(packet_header_t) + sizeof(packet_burst_t) );
+    }
+    else if( time_transfer_due() )
+    {
+      time_transfer_request( request );
+      request->stack_used = stack_used;
+      header->type = TIME_REQUEST_PACKET;
+      header->length = sizeof(packet_header_t) + 
+                                            sizeof(packet_time_request_t) - 1;
+      radio_tx_prepare( tx_buffer, 
+                      sizeof(packet_header_t) + sizeof(packet_time_request_t) );
+      
+      // Opens once the request is out
+      radio_rx_window( TIME_TRANSFER_WINDOW, 0 );
+    }
+    else
+    {
+      TA0CCR2 = next_slot - TX_PREPARE_LEAD;
+      return 0;
+    }
+    
+    tx_ready = 1;
+    TA0CCR2 = slot;
+    
+    return 0;
+  }
+  
+  time_transfer_cycle();
+  
+  if( (uint32_t)slot + MAJOR_CYCLE * ( own_slot.period - 1 ) > 
+                                                            MAJOR_CYCLE_LOOP )
+  {
+    next_slot = slot_time;
+  }
+  else if( burst_pending() || 
+          ( ( 0 == missed_beacons ) && time_transfer_due() ) )
   {
-    TA0CCR2 = ( REST_TIME/2 ) + MINOR_CYCLE * (DEVICE_ADDRESS - 1);
+    in_spare_slot = 1;
+    next_slot = slot + BURST_SLOT_OFFSET;
+    
+    // Up to date for the request, measured before the spare slot comes up
+    stack_measure = time_transfer_due();
   }
   else
   {
-    TA0CCR2 += ( MAJOR_CYCLE );
+    next_slot = slot + MAJOR_CYCLE * own_slot.period;
   }
   
-  
   data = (packet_data_t*)(tx_buffer + sizeof(packet_header_t));
   
+  header->type = SAMPLES_PACKET;
+  header->length = sizeof(packet_header_t) + sizeof(packet_data_t) - 1;
+  data->sample_rate = SAMPLE_RATE / own_slot.period;
   memcpy( data->samples, &sample_buffer[ current_buffer * ADC_MAX_SAMPLES ], 
   ( sizeof(sample_buffer) / 2 ) );
   
-  radio_tx( tx_buffer, sizeof(packet_header_t) + sizeof(packet_data_t) );
+  radio_tx_prepare( tx_buffer, sizeof(packet_header_t) + sizeof(packet_data_t) );
+  
+  tx_ready = 1;
+  TA0CCR2 = slot;
+  
+  // Wake main up for the stack measurement
+  return stack_measure;
+}
+
+/*******************************************************************************
+ * @fn     uint8_t beacon_window()
+ * @brief  Called BEACON_GUARD ticks before the end of every superframe. Opens
+ *         an RX window if a sync message is due. If too many get missed, the
+ *         receiver stays on until one comes in
+ * ****************************************************************************/
+uint8_t beacon_window()
+{
+  if( superframes_to_beacon > 0 )
+  {
+    superframes_to_beacon--;
+  }
+  
+  if( 0 == superframes_to_beacon )
+  {
+    if( missed_beacons < MAX_MISSED_BEACONS )
+    {
+      // Window opens before the sync message, so it can't be ended early 
+      // for lack of carrier
+      radio_rx_window( BEACON_WINDOW, 0 );
+    }
+    else
+    {
+      radio_listen( 1 );
+    }
+  }
   
   return 0;
 }
 
+/*******************************************************************************
+ * @fn     uint8_t beacon_window_check()
+ * @brief  Called after the RX window for a sync message should have closed. If
+ *         it closed without a sync message, it was missed, try again next 
+ *         superframe
+ * ****************************************************************************/
+uint8_t beacon_window_check()
+{
+  // Only count windows opened for a sync message
+  if( ( 0 == superframes_to_beacon ) && radio_window_empty() )
+  {
+    missed_beacons++;
+  }
+  
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn     uint16_t own_slot_time()
+ * @brief  Start of this device's first slot in the superframe, corrected by 
+ *         slot_offset
+ * ****************************************************************************/
+uint16_t own_slot_time()
+{
+  return ( REST_TIME/2 ) + MINOR_CYCLE * own_slot.position + 
+                                  MAJOR_CYCLE * own_slot.phase - slot_offset;
+}
+
 /*******************************************************************************
  * @fn     void setup_adc()
  * @brief  TODO (Code from VIBE)
@@ -213,25 +499,58 @@ void setup_adc()
  * @brief	ADC ISR. Peripherals using ADC include:
  * 			gyroscope - 3 channels for triple-axis gyro data
  * ***************************************************************************/
-wakeup interrupt (ADC12_VECTOR) ADC12ISR(void) 	// CHANGE
+interrupt (ADC12_VECTOR) ADC12ISR(void)
 {
+  uint8_t sample;
+  uint8_t wake = 0;
+  
 	switch(ADC12IV)
 	{
 	case  6:	// Vector  6:  ADC12IFG0
 
-    // This will be in ADC ISR, just testing for now
-    sample_buffer[buffer_index] = (uint8_t)(ADC12MEM0>>4);       
-    buffer_index++;
+    sample = (uint8_t)(ADC12MEM0>>4);
     
-     if ( (ADC_MAX_SAMPLES) == buffer_index )
-    {      
-        current_buffer = 0;
-        
+    // Every sample goes into the burst ring, a sudden change starts a burst
+    wake |= burst_sample( sample );
+    if( ( sample > last_sample + BURST_THRESHOLD ) || 
+        ( sample + BURST_THRESHOLD < last_sample ) )
+    {
+      wake |= burst_trigger();
     }
-    else if( (2*ADC_MAX_SAMPLES) == buffer_index )
+    
+    // Stream the average of every BURST_DECIMATION samples
+    decimation_sum += sample;
+    decimation_count++;
+    if( BURST_DECIMATION == decimation_count )
     {
-        buffer_index = 0;
-        current_buffer = 1;       
+      last_sample = (uint8_t)( decimation_sum / BURST_DECIMATION );
+      decimation_sum = 0;
+      decimation_count = 0;
+      
+      // A device sending every own_slot.period major cycles averages that 
+      // many samples again, so one buffer fills per transmission
+      period_sum += last_sample;
+      period_count++;
+      if( own_slot.period <= period_count )
+      {
+        // This will be in ADC ISR, just testing for now
+        sample_buffer[buffer_index] = (uint8_t)( period_sum / period_count );
+        buffer_index++;
+        period_sum = 0;
+        period_count = 0;
+        wake = 1;
+        
+         if ( (ADC_MAX_SAMPLES) == buffer_index )
+        {      
+            current_buffer = 0;
+            
+        }
+        else if( (2*ADC_MAX_SAMPLES) == buffer_index )
+        {
+            buffer_index = 0;
+            current_buffer = 1;       
+        }
+      }
     }
 
 		led1_off();
@@ -240,8 +559,12 @@ wakeup interrupt (ADC12_VECTOR) ADC12ISR(void) 	// CHANGE
 	default: break;
 	}
 
-  // Exit from low-power mode on return from interrupt
-//	_BIC_SR_IRQ(LPM0_bits);
+  // Only wake main up for a streamed sample or a burst starting or ending, 
+  // not for every ADC_RATE sample
+  if( wake )
+  {
+    __bic_SR_register_on_exit(LPM3_bits);
+  }
 
 }
 
@@ -0,0 +1,234 @@
+/** @file flow_control.c
+*
+* @brief Access point credit based flow control for frames sent to the host.
+*         Frames are queued (by the ISRs that produce them) and sent from 
+*         main, highest priority and oldest first, so writing to the UART 
+*         never holds up an ISR. Until the host grants its first credit, 
+*         frames go out as soon as main gets to them. After that, every frame
+*         costs one credit and they are only sent while there are credits. 
+*         When the queue is full, the oldest frame of the lowest priority is
+*         dropped. Drop counts go out in a FLOW_DROPS_PACKET frame as soon as
+*         there are credits again.
+*
+* @author Alvaro Prieto
+*/
+#include <signal.h>
+#include <string.h>
+#include "intrinsics.h"
+#include "radio.h"
+#include "uart.h"
+#include "flow_control.h"
+
+#define NO_FRAME (0xFF)
+
+#define DROPS_HEADER_SIZE (4)
+
+typedef struct
+{
+  uint8_t length; // 0 if free
+  uint8_t priority;
+  uint16_t order; // Increments with every queued frame
+  uint8_t data[FLOW_FRAME_SIZE];
+} flow_frame_t;
+
+static flow_frame_t queue[FLOW_QUEUE_FRAMES];
+static uint16_t next_order = 0;
+static uint8_t sending = NO_FRAME;
+
+static volatile uint8_t enabled = 0;
+static volatile uint16_t credits = 0;
+
+// Frames dropped since the last report, per priority
+static uint16_t dropped[FLOW_PRIORITIES];
+static uint8_t drops_buffer[DROPS_HEADER_SIZE + sizeof(dropped)];
+
+static uint8_t find_slot( uint8_t );
+static uint8_t next_frame( void );
+
+/*******************************************************************************
+ * @fn     void flow_control_write( uint8_t* buffer, uint8_t length, 
+ *                                                          uint8_t priority )
+ * @brief  Queue a frame for the host, flow_control_send() writes it. Only 
+ *         called from ISRs, which have to wake main up afterwards
+ * ****************************************************************************/
+void flow_control_write( uint8_t* buffer, uint8_t length, uint8_t priority )
+{
+  uint8_t slot;
+  
+  if( length > FLOW_FRAME_SIZE )
+  {
+    dropped[priority]++;
+    return;
+  }
+  
+  slot = find_slot( priority );
+  if( NO_FRAME == slot )
+  {
+    // Everything queued is more important
+    dropped[priority]++;
+    return;
+  }
+  
+  if( queue[slot].length )
+  {
+    dropped[queue[slot].priority]++;
+  }
+  
+  memcpy( queue[slot].data, buffer, length );
+  queue[slot].length = length;
+  queue[slot].priority = priority;
+  queue[slot].order = next_order++;
+}
+
+/*******************************************************************************
+ * @fn     uint8_t flow_control_credit( uint8_t count )
+ * @brief  The host can take [count] more frames. Called from the UART ISR,
+ *         returns 1 so main wakes up to send them
+ * ****************************************************************************/
+uint8_t flow_control_credit( uint8_t count )
+{
+  enabled = 1;
+  
+  if( credits < FLOW_MAX_CREDITS )
+  {
+    credits += count;
+  }
+  
+  return 1;
+}
+
+/*******************************************************************************
+ * @fn     void flow_control_send( void )
+ * @brief  Send queued frames while there are credits, or all of them before
+ *         the first credit comes in. Called from main
+ * ****************************************************************************/
+void flow_control_send( void )
+{
+  uint16_t interrupt_state;
+  uint8_t slot;
+  uint8_t priority;
+  
+  for(;;)
+  {
+    interrupt_state = __get_interrupt_state();
+    dint();
+    
+    if( enabled && ( 0 == credits ) )
+    {
+      __set_interrupt_state( interrupt_state );
+      return;
+    }
+    
+    // Let the host know what it missed before anything else
+    for( priority = 0; priority < FLOW_PRIORITIES; priority++ )
+    {
+      if( dropped[priority] )
+      {
+        break;
+      }
+    }
+    
+    if( enabled && ( priority < FLOW_PRIORITIES ) )
+    {
+      drops_buffer[0] = sizeof(drops_buffer) - 1; // Length doesn't count itself
+      drops_buffer[1] = DEVICE_ADDRESS;
+      drops_buffer[2] = FLOW_DROPS_PACKET;
+      drops_buffer[3] = FLOW_PRIORITIES;
+      memcpy( &drops_buffer[DROPS_HEADER_SIZE], dropped, sizeof(dropped) );
+      memset( dropped, 0x00, sizeof(dropped) );
+      credits--;
+      
+      __set_interrupt_state( interrupt_state );
+      
+      uart_write_frame( drops_buffer, sizeof(drops_buffer) );
+      continue;
+    }
+    
+    slot = next_frame();
+    if( NO_FRAME == slot )
+    {
+      __set_interrupt_state( interrupt_state );
+      return;
+    }
+    
+    // ISRs may queue more frames meanwhile, but not over this one
+    sending = slot;
+    if( enabled )
+    {
+      credits--;
+    }
+    
+    __set_interrupt_state( interrupt_state );
+    
+    uart_write_frame( queue[slot].data, queue[slot].length );
+    
+    dint();
+    queue[slot].length = 0;
+    sending = NO_FRAME;
+    __set_interrupt_state( interrupt_state );
+  }
+}
+
+/*******************************************************************************
+ * @fn     uint8_t find_slot( uint8_t priority )
+ * @brief  Free queue slot, or else the oldest frame of the lowest priority
+ *         that isn't above [priority]. NO_FRAME if there is none
+ * ****************************************************************************/
+static uint8_t find_slot( uint8_t priority )
+{
+  uint8_t slot;
+  uint8_t victim = NO_FRAME;
+  
+  for( slot = 0; slot < FLOW_QUEUE_FRAMES; slot++ )
+  {
+    if( 0 == queue[slot].length )
+    {
+      return slot;
+    }
+    
+    if( ( slot == sending ) || ( queue[slot].priority > priority ) )
+    {
+      continue;
+    }
+    
+    if( ( NO_FRAME == victim ) || 
+        ( queue[slot].priority < queue[victim].priority ) ||
+        ( ( queue[slot].priority == queue[victim].priority ) && 
+          ( (uint16_t)( next_order - queue[slot].order ) > 
+            (uint16_t)( next_order - queue[victim].order ) ) ) )
+    {
+      victim = slot;
+    }
+  }
+  
+  return victim;
+}
+
+/*******************************************************************************
+ * @fn     uint8_t next_frame( void )
+ * @brief  Oldest frame of the highest priority, NO_FRAME if the queue is empty
+ * ****************************************************************************/
+static uint8_t next_frame( void )
+{
+  uint8_t slot;
+  uint8_t next = NO_FRAME;
+  
+  for( slot = 0; slot < FLOW_QUEUE_FRAMES; slot++ )
+  {
+    if( 0 == queue[slot].length )
+    {
+      continue;
+    }
+    
+    if( ( NO_FRAME == next ) || 
+        ( queue[slot].priority > queue[next].priority ) ||
+        ( ( queue[slot].priority == queue[next].priority ) && 
+          ( (uint16_t)( next_order - queue[slot].order ) > 
+            (uint16_t)( next_order - queue[next].order ) ) ) )
+    {
+      next = slot;
+    }
+  }
+  
+  return next;
+}
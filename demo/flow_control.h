@@ -0,0 +1,22 @@
+/** @file flow_control.h
+*
+* @brief Access point credit based flow control for frames sent to the host
+*
+* @author Alvaro Prieto
+*/
+#ifndef _FLOW_CONTROL_H
+#define _FLOW_CONTROL_H
+
+#include "settings.h"
+
+// Frame priorities, lowest is dropped first when the queue is full
+#define FLOW_PRIORITY_LOW (0) // Bulk data (bursts)
+#define FLOW_PRIORITY_NORMAL (1) // Sample data
+#define FLOW_PRIORITY_HIGH (2) // Network status and reports
+#define FLOW_PRIORITIES (3)
+
+void flow_control_write( uint8_t*, uint8_t, uint8_t );
+uint8_t flow_control_credit( uint8_t );
+void flow_control_send( void );
+
+#endif /* _FLOW_CONTROL_H */
@@ -0,0 +1,119 @@
+/** @file packets.h
+*
+* @brief Packet formats shared by the access point, relays and end devices
+*
+* @author Alvaro Prieto
+*/
+#ifndef _PACKETS_H
+#define _PACKETS_H
+
+#include "settings.h"
+#include "radio.h"
+
+// Set with NETWORK= on the make command line, see radio_set_network()
+#if NETWORK_ID >= TOTAL_NETWORKS
+#error "NETWORK_ID must be below TOTAL_NETWORKS"
+#endif
+
+typedef struct
+{
+  uint8_t length;
+  uint8_t source;
+  uint8_t type;
+  uint8_t flags;
+} packet_header_t;
+
+// Where and how often a device transmits, see SLOT_SCHEDULE
+typedef struct
+{
+  uint8_t position; // Slot within the major cycle
+  uint8_t period; // Major cycles between transmissions
+  uint8_t phase; // Major cycle within the period
+} slot_schedule_t;
+
+typedef struct
+{
+  uint16_t sample_rate; // Exact sample rate in Hz
+  uint8_t samples[ADC_MAX_SAMPLES];
+} packet_data_t;
+
+// Payload of the sync message sent by the access point
+typedef struct
+{
+  // Superframes until the next sync message
+  uint8_t interval;
+  
+  // Slot timing error measured by the AP for each device during the
+  // superframe after the previous sync message, in timer ticks. Positive 
+  // means the device transmitted late
+  int8_t slot_offset[MAX_DEVICES];
+  
+  // Bit (address - 1) set asks that device to capture a burst
+  uint8_t burst_request;
+} packet_sync_t;
+
+#define BURST_CHUNK_SAMPLES (ADC_MAX_SAMPLES - 4)
+
+// Part of a burst capture, sent in the device's spare slot
+typedef struct
+{
+  uint8_t burst; // Increments with every burst
+  uint8_t chunk; // 0 holds the oldest samples
+  uint8_t pre_chunks; // Chunks recorded before the trigger
+  uint8_t total_chunks;
+  uint16_t sample_rate; // Exact sample rate in Hz
+  uint8_t samples[BURST_CHUNK_SAMPLES];
+} packet_burst_t;
+
+// Sent by an end device in its spare slot to start a two-way time transfer.
+// Carries the statistics of the last TIME_STATS_EXCHANGES exchanges, in
+// 1/TIME_SUBTICKS ticks. Offset is AP time minus device time
+typedef struct
+{
+  uint8_t sequence;
+  uint8_t report; // Increments with every new set of statistics
+  uint8_t exchanges;
+  int8_t correction; // Timer restart correction used on sync messages (ticks)
+  int16_t offset_min;
+  int16_t offset_max;
+  int16_t offset_sum; // Sums stop at INT16_MIN/INT16_MAX
+  int16_t delay_sum; // One way
+  uint16_t stack_used; // Worst-case stack use on the device, in bytes
+} packet_time_request_t;
+
+// AP's answer to a time transfer request
+typedef struct
+{
+  uint8_t destination;
+  uint8_t sequence; // Of the request being answered
+  uint16_t request_time; // TA0R when the request's sync word came in
+  uint16_t last_response_time; // TA0R when the previous answer to the same
+                               // device was sent (its sync word went out)
+  uint8_t last_sequence; // Sequence of that answer
+  uint8_t request_fraction; // Sub-tick parts of the two times above, in
+  uint8_t last_response_fraction; // 1/TIMESTAMP_FRACTION ticks
+} packet_time_response_t;
+
+typedef struct
+{
+  uint8_t rssi;
+  uint8_t lqi_crcok;
+} packet_footer_t;
+
+// Host commands are sent to the AP over the UART, one byte each. The top 
+// nibble selects the command, the bottom one is its argument
+#define COMMAND_MASK (0xF0)
+
+// Host command 0xB0 | address asks that device to capture a burst
+#define BURST_COMMAND (0xB0)
+
+// Host command 0xE0 | n grants the AP n more frame credits, see flow_control.c
+#define CREDIT_COMMAND (0xE0)
+
+// Host command 0xF0 | framing selects the AP's serial frame format, see uart.h
+#define FRAMING_COMMAND (0xF0)
+
+// Largest packet used by the network (not counting the length byte)
+#define MAX_PACKET_LENGTH (sizeof(packet_header_t) + sizeof(packet_data_t) - 1)
+
+#endif /* _PACKETS_H */
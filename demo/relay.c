@@ -12,25 +12,7 @@
 #include "oscillator.h"
 #include "timers.h"
 #include "radio.h"
-
-typedef struct
-{
-  uint8_t length;
-  uint8_t source;
-  uint8_t type;
-  uint8_t flags;
-} packet_header_t;
-
-typedef struct
-{
-  uint8_t samples[ADC_MAX_SAMPLES];
-} packet_data_t;
-
-typedef struct
-{
-  uint8_t rssi;
-  uint8_t lqi_crcok;
-} packet_footer_t;
+#include "packets.h"
 
 uint8_t heartbeat();
 uint8_t process_rx( uint8_t*, uint8_t );
@@ -60,6 +42,9 @@ int main( void )
   // Initialize radio and enable receive callback function
   setup_radio( process_rx );
   
+  // Ignore other networks and anything longer than our own packets
+  radio_set_network( NETWORK_ID, MAX_PACKET_LENGTH );
+  
   // Full Power
   WriteSinglePATable(0xC0);
   
@@ -121,9 +106,12 @@ uint8_t process_rx( uint8_t* buffer, uint8_t size )
   //memset( buffer, 0x00, size );
   
   led3_toggle();
-  if( header->type == 0xAA )
+  if( ( header->type == SAMPLES_PACKET ) && !( header->flags & REPEATER_FLAG ) )
   {
     memcpy( tx_buffer, buffer, sizeof(packet_header_t) + sizeof(packet_data_t) );  
+    
+    // Mark it as relayed so it isn't relayed again or used for slot timing
+    ((packet_header_t*)tx_buffer)->flags |= REPEATER_FLAG;
     new_message = 1;
   }
   
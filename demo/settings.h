@@ -13,17 +13,143 @@
 
 #define MAX_DEVICES (5)
 
-#define TIMER_LIMIT (65400)
+// Slots in every major cycle
+#define SLOT_POSITIONS (5)
 
-#define SAMPLE_RATE (109)
+// Slot position, period (1, 2 or 4 major cycles) and phase (which major cycle
+// of the period) of each device, in address order. Low rate devices can share
+// a position as long as their phases differ, e.g. with MAX_DEVICES at 8:
+//   { 3, 2, 0 }, { 3, 2, 1 }, { 4, 4, 0 }, { 4, 4, 1 }, { 4, 4, 2 }
+// for devices 4 to 8. Periods count major cycles from the start of the
+// superframe. A device streams at SAMPLE_RATE / period, so every packet still
+// covers its whole period. The sync message bitmasks limit MAX_DEVICES to 8
+#define SLOT_SCHEDULE \
+  { { 0, 1, 0 }, { 1, 1, 0 }, { 2, 1, 0 }, { 3, 1, 0 }, { 4, 1, 0 } }
 
-#define REST_TIME (300)
+// Sample rate in Hz. The sample timer keeps the average rate exact
+#define SAMPLE_RATE (320)
+
+#define ACLK_FREQUENCY (32768)
+
+// The ADC runs BURST_DECIMATION times faster than SAMPLE_RATE. Streamed
+// samples are averages, burst captures keep every sample
+#define BURST_DECIMATION (4)
+
+#define ADC_RATE (SAMPLE_RATE * BURST_DECIMATION)
+
+// Burst capture ring size and how much of it is from before the trigger, in
+// chunks of BURST_CHUNK_SAMPLES. RAM is the limit here (4kB total)
+#define BURST_CHUNKS (20)
+#define BURST_PRE_CHUNKS (10)
+
+// A burst is triggered locally when a sample differs from the last streamed
+// (averaged) sample by more than this
+#define BURST_THRESHOLD (64)
+
+// Each device uploads bursts in a spare slot, this far after its own slot
+#define BURST_SLOT_OFFSET (SLOT_POSITIONS * MINOR_CYCLE)
+
+// Every TIME_TRANSFER_INTERVAL major cycles, a device that has the sync 
+// messages uses its spare slot for a two-way time transfer with the AP (0 turns
+// it off). The AP's answer has to come in within TIME_TRANSFER_WINDOW ticks
+#define TIME_TRANSFER_INTERVAL (16)
+#define TIME_TRANSFER_WINDOW (150)
+
+// Ticks from the AP reading a time transfer request until it answers
+#define TIME_RESPONSE_DELAY (10)
+
+// Exchanges per time transfer report. A device restarts its timer on sync 
+// messages at SLOT_SYNC_DELAY (the AP's sync word) plus the time measured
+// since its own sync word capture. The mean offset of each report corrects
+// what is left, the error in SLOT_SYNC_DELAY, so it is limited to as much
+#define TIME_STATS_EXCHANGES (8)
+#define TIME_CORRECTION_MAX (SLOT_SYNC_DELAY)
+
+// Timestamp radio sync words to a fraction of a tick on the access point (1 
+// turns it on, see radio_fine_timestamps()). Time transfer statistics are in 
+// 1/TIME_SUBTICKS ticks, ~1us
+#define FINE_TIMESTAMPS (1)
+#define TIME_SUBTICKS (32)
+
+// Each device sends ADC_MAX_SAMPLES samples every major cycle, so a major
+// cycle is exactly that many SAMPLE_RATE periods. A superframe is MAJOR_CYCLES
+// major cycles, TIMER_LIMIT + 1 ticks. End devices line their sample phase up
+// with the start of every superframe, so it has to be a whole number of ADC 
+// sample periods too
+#define MAJOR_CYCLES (12)
+
+#define MAJOR_CYCLE (ADC_MAX_SAMPLES * ACLK_FREQUENCY / SAMPLE_RATE)
+
+#define TIMER_LIMIT (MAJOR_CYCLES * MAJOR_CYCLE - 1)
 
-#define MAJOR_CYCLE (5450)
+#if ( ( ADC_MAX_SAMPLES * ACLK_FREQUENCY ) % SAMPLE_RATE ) != 0
+#error "ADC_MAX_SAMPLES sample periods must be a whole number of ticks"
+#endif
+
+#if TIMER_LIMIT > 0xFFFF
+#error "MAJOR_CYCLES major cycles don't fit in the timer"
+#endif
+
+#define REST_TIME (300)
 
 #define MINOR_CYCLE (495)
 
-#define MAJOR_CYCLE_LOOP (60000)
+// After sending in the first slot past this, a device starts over in the first
+// major cycle. Halfway between the slots of the last two major cycles
+#define MAJOR_CYCLE_LOOP \
+  ( (REST_TIME/2) + MAJOR_CYCLE * (MAJOR_CYCLES - 1) - (MAJOR_CYCLE/2) )
+
+// Frames are loaded into the radio and the synthesizer calibrated this many
+// ticks before a slot (or sync message) starts, so transmission starts right
+// on time
+#define TX_PREPARE_LEAD (40)
+
+// Nominal ticks from the start of a transmission (a slot, or a sync message
+// at 0) until its sync word is received (preamble and sync word, the radio is
+// calibrated beforehand). End devices are steered so their sync word arrives
+// at this point
+#define SLOT_SYNC_DELAY (10)
+
+// Ticks after the start of a slot at which the AP samples the channel RSSI
+#define SLOT_SAMPLE_OFFSET (40)
+
+// Latest timer value an end device restarts at after a sync message: the
+// AP's sync word, the rest of the sync message on the air (~15 ticks for 8 
+// devices), reading it and the time transfer correction
+#define SYNC_RESTART_MAX (2 * SLOT_SYNC_DELAY + 30)
+
+// Largest slot timing correction an end device will apply. The first slot
+// still has to be prepared after the timer restarts
+#define MAX_SLOT_OFFSET (REST_TIME/2 - TX_PREPARE_LEAD - SYNC_RESTART_MAX)
+
+// The sync message interval (in superframes) is doubled while the worst
+// device timing error stays at or below SYNC_ERROR_LOW ticks, and halved 
+// with the next sync message once it goes over SYNC_ERROR_HIGH ticks
+#define MAX_BEACON_INTERVAL (8)
+#define SYNC_ERROR_LOW (2)
+#define SYNC_ERROR_HIGH (8)
+
+// Ticks before the expected sync message at which end devices start listening
+#define BEACON_GUARD (100)
+
+// Longest an end device listens for a sync message (ticks). The radio ends
+// the window by itself, the device checks BEACON_CHECK_DELAY ticks later.
+// After MAX_MISSED_BEACONS empty windows in a row it listens continuously
+#define BEACON_WINDOW (2 * BEACON_GUARD)
+#define BEACON_CHECK_DELAY (10)
+#define MAX_MISSED_BEACONS (3)
+
+// Frames the AP can hold for the host while it is out of credits, and the
+// largest frame that fits: slot statistics (FLOW_STATS_SIZE bytes, see 
+// export_stats()) or a radio frame (at most 62 bytes with its length byte).
+// Credits beyond FLOW_MAX_CREDITS are ignored
+#define FLOW_QUEUE_FRAMES (8)
+#define FLOW_STATS_SIZE (8 + 16 * MAX_DEVICES)
+#define FLOW_FRAME_SIZE ( FLOW_STATS_SIZE > 62 ? FLOW_STATS_SIZE : 62 )
+#define FLOW_MAX_CREDITS (255)
+
+// Channel RSSI (dBm) above which a slot without a sync word counts as noise
+#define SLOT_BUSY_RSSI (-90)
 
 
 #endif /* _SETTINGS_H */\
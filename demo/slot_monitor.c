@@ -0,0 +1,430 @@
+/** @file slot_monitor.c
+*
+* @brief Access point slot occupancy monitor.
+*         Every slot position is classified once per major cycle using the
+*         sync word/CRC statistics from the radio and an RSSI sample taken
+*         during the slot, and counted for the device scheduled in it that
+*         major cycle (see SLOT_SCHEDULE). Statistics per device, and how many
+*         of the superframe's slots were scheduled and used, are queued for 
+*         the host once per superframe, in the quiet time before the next 
+*         sync message, and written to the UART from main.
+*         The sync word of every frame is also timestamped against the
+*         schedule, the mean error per device is sent back in the sync message
+*         so devices can line up with their slots.
+*
+* @author Alvaro Prieto
+*/
+#include "slot_monitor.h"
+#include <string.h>
+#include "timers.h"
+#include "radio.h"
+#include "flow_control.h"
+#include "packets.h"
+#include "slot_schedule.h"
+
+// Events handled for every slot
+#define PHASE_START (0) // Clear radio statistics
+#define PHASE_SAMPLE (1) // Sample RSSI while the frame should be on the air
+#define PHASE_END (2) // Classify slot
+
+#define STATS_HEADER_SIZE (8)
+
+// No device scheduled in a slot
+#define NO_DEVICE (0xFF)
+
+static uint8_t slot_monitor_event();
+static uint8_t classify_slot( radio_status_t*, int8_t );
+static void update_stats( uint8_t, uint8_t, int8_t );
+static void export_stats();
+static void update_offsets();
+static uint8_t slot_owner( uint8_t, uint8_t );
+
+static slot_stats_t slot_stats[MAX_DEVICES];
+static uint8_t stats_buffer[STATS_HEADER_SIZE + sizeof(slot_stats)];
+
+// Running RSSI averages, scaled by 8 so small steps aren't lost
+static int16_t rssi_average[MAX_DEVICES];
+
+static uint8_t monitor_ccr;
+static uint8_t current_slot;
+static uint8_t current_cycle;
+static uint8_t phase;
+static int8_t peak_rssi;
+
+// Slots in the current superframe, how many had a device scheduled and how
+// many of those were received fine
+static uint8_t slots_total;
+static uint8_t slots_scheduled;
+static uint8_t slots_ok;
+
+// Sync word timing errors collected during the current superframe
+static int16_t offset_sum[MAX_DEVICES];
+static uint8_t offset_count[MAX_DEVICES];
+static int8_t slot_offset[MAX_DEVICES];
+
+// Set when a sync message starts the current superframe
+static uint8_t synced;
+
+// Largest timing error of any device since the last sync message
+static uint8_t sync_error;
+
+/*******************************************************************************
+ * @fn     uint16_t slot_start( uint8_t cycle, uint8_t slot )
+ * @brief  Timer value at which [slot] of major cycle [cycle] starts. Matches
+ *         the schedule used by end devices in send_samples()
+ * ****************************************************************************/
+static uint16_t slot_start( uint8_t cycle, uint8_t slot )
+{
+  return ( REST_TIME/2 ) + MINOR_CYCLE * slot + MAJOR_CYCLE * cycle;
+}
+
+/*******************************************************************************
+ * @fn     void setup_slot_monitor( uint8_t ccr_number )
+ * @brief  Start monitoring slots using CCR[ccr_number]. Must be called after
+ *         setup_timer_a()
+ * ****************************************************************************/
+void setup_slot_monitor( uint8_t ccr_number )
+{
+  monitor_ccr = ccr_number;
+  current_slot = 0;
+  current_cycle = 0;
+  phase = PHASE_START;
+  slots_total = 0;
+  slots_scheduled = 0;
+  slots_ok = 0;
+  
+  memset( slot_stats, 0x00, sizeof(slot_stats) );
+  memset( rssi_average, 0x00, sizeof(rssi_average) );
+  memset( offset_sum, 0x00, sizeof(offset_sum) );
+  memset( offset_count, 0x00, sizeof(offset_count) );
+  memset( slot_offset, 0x00, sizeof(slot_offset) );
+  
+  register_timer_callback( slot_monitor_event, monitor_ccr );
+  set_ccr( monitor_ccr, slot_start( 0, 0 ) );
+}
+
+/*******************************************************************************
+ * @fn     uint8_t slot_monitor_event()
+ * @brief  Timer callback, handles the current slot phase and schedules the
+ *         next one
+ * ****************************************************************************/
+static uint8_t slot_monitor_event()
+{
+  radio_status_t status;
+  int8_t rssi;
+  uint8_t slot_class;
+  uint8_t device;
+  uint8_t wake_up = 0;
+  
+  switch( phase )
+  {
+    case (PHASE_START):
+    {
+      // Throw away anything heard between slots
+      radio_read_status( &status );
+      
+      phase = PHASE_SAMPLE;
+      set_ccr( monitor_ccr, 
+                slot_start( current_cycle, current_slot ) + SLOT_SAMPLE_OFFSET );
+      break;
+    }
+    
+    case (PHASE_SAMPLE):
+    {
+      peak_rssi = radio_rssi();
+      
+      phase = PHASE_END;
+      set_ccr( monitor_ccr, slot_start( current_cycle, current_slot + 1 ) );
+      break;
+    }
+    
+    case (PHASE_END):
+    {
+      radio_read_status( &status );
+      
+      // Use the frame RSSI if it was higher than the sample
+      rssi = peak_rssi;
+      if( ( status.frames || status.crc_errors ) && ( status.rssi > rssi ) )
+      {
+        rssi = status.rssi;
+      }
+      
+      slot_class = classify_slot( &status, rssi );
+      slots_total++;
+      
+      // Unscheduled slots only count towards the superframe total
+      device = slot_owner( current_cycle, current_slot );
+      if( NO_DEVICE != device )
+      {
+        update_stats( device, slot_class, rssi );
+        
+        slots_scheduled++;
+        if( SLOT_OK == slot_class )
+        {
+          slots_ok++;
+        }
+      }
+      
+      current_slot++;
+      if( current_slot < SLOT_POSITIONS )
+      {
+        // Next slot starts right now, statistics were just cleared
+        phase = PHASE_SAMPLE;
+        set_ccr( monitor_ccr, 
+                slot_start( current_cycle, current_slot ) + SLOT_SAMPLE_OFFSET );
+        break;
+      }
+      
+      current_slot = 0;
+      
+      // End devices wrap to the next superframe after the first major cycle
+      // starting past MAJOR_CYCLE_LOOP (see send_samples()), so that is the
+      // last one. Nothing else is scheduled until the timer wraps around
+      if( slot_start( current_cycle, 0 ) > MAJOR_CYCLE_LOOP )
+      {
+        current_cycle = 0;
+        update_offsets();
+        export_stats();
+        
+        // Main writes the statistics out
+        wake_up = 1;
+      }
+      else
+      {
+        current_cycle++;
+      }
+      
+      phase = PHASE_START;
+      set_ccr( monitor_ccr, slot_start( current_cycle, 0 ) );
+      break;
+    }
+    
+    default:
+    {
+      //Shouldn't happen...
+      break;
+    }
+  }
+  
+  return wake_up;
+}
+
+/*******************************************************************************
+ * @fn     void slot_monitor_frame( uint8_t source, uint16_t sync_time )
+ * @brief  Record when the sync word of a frame from [source] was received.
+ *         Called from the rx callback
+ * ****************************************************************************/
+void slot_monitor_frame( uint8_t source, uint16_t sync_time )
+{
+  uint8_t device;
+  uint16_t nominal;
+  int16_t offset;
+  
+  if( ( source == 0 ) || ( source > MAX_DEVICES ) )
+  {
+    return;
+  }
+  
+  device = source - 1;
+  nominal = slot_start( 0, slot_schedule[device].position ) + SLOT_SYNC_DELAY;
+  
+  // Offset from the same slot position in the closest major cycle, the
+  // device's phase doesn't change where the position is within the cycle
+  if( sync_time < nominal )
+  {
+    offset = -(int16_t)( nominal - sync_time );
+  }
+  else
+  {
+    offset = ( sync_time - nominal ) % MAJOR_CYCLE;
+    if( offset > ( MAJOR_CYCLE / 2 ) )
+    {
+      offset -= MAJOR_CYCLE;
+    }
+  }
+  
+  // Anything this far off is not a transmission in its own slot
+  if( ( offset > ( MINOR_CYCLE / 2 ) ) || ( offset < -( MINOR_CYCLE / 2 ) ) )
+  {
+    return;
+  }
+  
+  offset_sum[device] += offset;
+  offset_count[device]++;
+}
+
+/*******************************************************************************
+ * @fn     void slot_monitor_offsets( int8_t* offsets )
+ * @brief  Copy the mean timing error of each device during the superframe
+ *         that followed the previous sync message into [offsets] 
+ *         (MAX_DEVICES entries). Must be called when a sync message is sent, 
+ *         the errors are only sent once
+ * ****************************************************************************/
+void slot_monitor_offsets( int8_t* offsets )
+{
+  memcpy( offsets, slot_offset, sizeof(slot_offset) );
+  memset( slot_offset, 0x00, sizeof(slot_offset) );
+  
+  synced = 1;
+  sync_error = 0;
+}
+
+/*******************************************************************************
+ * @fn     uint8_t slot_monitor_sync_error()
+ * @brief  Largest timing error (in ticks) of any device in any superframe since
+ *         the last sync message
+ * ****************************************************************************/
+uint8_t slot_monitor_sync_error()
+{
+  return sync_error;
+}
+
+/*******************************************************************************
+ * @fn     void update_offsets()
+ * @brief  Compute the mean timing error of each device at the end of a
+ *         superframe and start collecting again. Devices only apply a
+ *         correction with each sync message, so only the superframe right
+ *         after one is used for corrections. Later ones add up clock drift
+ * ****************************************************************************/
+static void update_offsets()
+{
+  uint8_t device;
+  int16_t offset;
+  
+  for( device = 0; device < MAX_DEVICES; device++ )
+  {
+    offset = 0;
+    
+    if( offset_count[device] )
+    {
+      offset = offset_sum[device] / offset_count[device];
+    }
+    
+    // Must fit in the sync message
+    if( offset > INT8_MAX )
+    {
+      offset = INT8_MAX;
+    }
+    else if( offset < INT8_MIN )
+    {
+      offset = INT8_MIN;
+    }
+    
+    if( synced )
+    {
+      slot_offset[device] = offset;
+    }
+    slot_stats[device].offset = offset;
+    
+    if( offset < 0 )
+    {
+      offset = -offset;
+    }
+    if( offset > sync_error )
+    {
+      sync_error = offset;
+    }
+    
+    offset_sum[device] = 0;
+    offset_count[device] = 0;
+  }
+  
+  synced = 0;
+}
+
+/*******************************************************************************
+ * @fn     uint8_t slot_owner( uint8_t cycle, uint8_t position )
+ * @brief  Index of the device scheduled in [position] of major cycle [cycle],
+ *         NO_DEVICE if none
+ * ****************************************************************************/
+static uint8_t slot_owner( uint8_t cycle, uint8_t position )
+{
+  uint8_t device;
+  
+  for( device = 0; device < MAX_DEVICES; device++ )
+  {
+    if( ( slot_schedule[device].position == position ) && 
+        ( ( cycle % slot_schedule[device].period ) == 
+                                              slot_schedule[device].phase ) )
+    {
+      return device;
+    }
+  }
+  
+  return NO_DEVICE;
+}
+
+/*******************************************************************************
+ * @fn     uint8_t classify_slot( radio_status_t* status, int8_t rssi )
+ * @brief  Figure out what happened during a slot
+ * ****************************************************************************/
+static uint8_t classify_slot( radio_status_t* status, int8_t rssi )
+{
+  uint8_t received = status->frames + status->crc_errors;
+  
+  if( ( status->syncs > 1 ) || ( received > 1 ) )
+  {
+    return SLOT_COLLISION;
+  }
+  else if( status->frames )
+  {
+    return SLOT_OK;
+  }
+  else if( status->syncs || status->crc_errors )
+  {
+    return SLOT_CRC_ERROR;
+  }
+  else if( rssi > RSSI_RAW( SLOT_BUSY_RSSI ) )
+  {
+    return SLOT_NOISE;
+  }
+  
+  return SLOT_EMPTY;
+}
+
+/*******************************************************************************
+ * @fn     void update_stats( uint8_t device, uint8_t slot_class, int8_t rssi )
+ * @brief  Add the latest slot result to the rolling statistics of [device]
+ * ****************************************************************************/
+static void update_stats( uint8_t device, uint8_t slot_class, int8_t rssi )
+{
+  slot_stats_t* stats = &slot_stats[device];
+  
+  stats->history <<= 1;
+  if( SLOT_OK == slot_class )
+  {
+    stats->history |= 1;
+  }
+  
+  stats->count[slot_class]++;
+  stats->last = slot_class;
+  
+  // Running average with a weight of 1/8 for the newest value. Rounding
+  // the scaled average both ways settles it on the input, not short of it
+  rssi_average[device] += (int16_t)rssi - ( ( rssi_average[device] + 4 ) >> 3 );
+  stats->rssi = (int8_t)( ( rssi_average[device] + 4 ) >> 3 );
+}
+
+/*******************************************************************************
+ * @fn     void export_stats()
+ * @brief  Queue slot statistics for the host, framed like a received packet
+ * ****************************************************************************/
+static void export_stats()
+{
+  stats_buffer[0] = sizeof(stats_buffer) - 1; // Length doesn't count itself
+  stats_buffer[1] = DEVICE_ADDRESS;
+  stats_buffer[2] = SLOT_STATS_PACKET;
+  stats_buffer[3] = MAX_DEVICES;
+  stats_buffer[4] = slots_total;
+  stats_buffer[5] = slots_scheduled;
+  stats_buffer[6] = slots_ok;
+  stats_buffer[7] = 0;
+  
+  memcpy( &stats_buffer[STATS_HEADER_SIZE], slot_stats, sizeof(slot_stats) );
+  
+  slots_total = 0;
+  slots_scheduled = 0;
+  slots_ok = 0;
+  
+  flow_control_write( stats_buffer, sizeof(stats_buffer), FLOW_PRIORITY_HIGH );
+}
@@ -0,0 +1,36 @@
+/** @file slot_monitor.h
+*
+* @brief Access point slot occupancy monitor
+*
+* @author Alvaro Prieto
+*/
+#ifndef _SLOT_MONITOR_H
+#define _SLOT_MONITOR_H
+
+#include "settings.h"
+
+// Slot classifications
+#define SLOT_EMPTY (0) // Nothing heard
+#define SLOT_OK (1) // One frame received with a good CRC
+#define SLOT_CRC_ERROR (2) // One frame with a bad CRC (or cut short)
+#define SLOT_COLLISION (3) // More than one frame heard in the slot
+#define SLOT_NOISE (4) // Energy in the slot, but no sync word
+#define SLOT_CLASSES (5)
+
+// Rolling health statistics kept for each device, over its scheduled slots
+typedef struct
+{
+  uint16_t history; // One bit per slot (newest is bit 0), set if slot was OK
+  uint16_t count[SLOT_CLASSES]; // Number of cycles in each class
+  int8_t rssi; // Running average of the peak (raw) RSSI seen in the slot
+  uint8_t last; // Most recent classification
+  int8_t offset; // Mean sync word timing error during the last superframe
+  uint8_t reserved;
+} slot_stats_t;
+
+void setup_slot_monitor( uint8_t );
+void slot_monitor_frame( uint8_t, uint16_t );
+void slot_monitor_offsets( int8_t* );
+uint8_t slot_monitor_sync_error();
+
+#endif /* _SLOT_MONITOR_H */
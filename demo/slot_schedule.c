@@ -0,0 +1,68 @@
+/** @file slot_schedule.c
+*
+* @brief Slot schedule shared by the access point and end devices.
+*         The number of entries is checked when building, the rest once at
+*         startup.
+*
+* @author Alvaro Prieto
+*/
+#include "slot_schedule.h"
+
+const slot_schedule_t slot_schedule[] = SLOT_SCHEDULE;
+
+// Fails the build (negative array size) unless SLOT_SCHEDULE has exactly 
+// MAX_DEVICES entries. A short schedule would otherwise be padded with zeros
+typedef uint8_t slot_schedule_entries_check
+  [ ( sizeof(slot_schedule) / sizeof(slot_schedule_t) == MAX_DEVICES ) ? 1 : -1 ];
+
+/*******************************************************************************
+ * @fn     uint8_t slot_schedule_valid( void )
+ * @brief  Returns 1 if every device has a slot position, a period of 1, 2 or 4
+ *         major cycles and a phase within it, and no two devices are ever 
+ *         scheduled in the same slot. Returns 0 otherwise
+ * ****************************************************************************/
+uint8_t slot_schedule_valid( void )
+{
+  uint8_t device;
+  uint8_t other;
+  uint8_t period;
+  
+  for( device = 0; device < MAX_DEVICES; device++ )
+  {
+    period = slot_schedule[device].period;
+    
+    if( ( slot_schedule[device].position >= SLOT_POSITIONS ) ||
+        ( ( period != 1 ) && ( period != 2 ) && ( period != 4 ) ) ||
+        ( slot_schedule[device].phase >= period ) )
+    {
+      return 0;
+    }
+  }
+  
+  // Periods divide each other, so two devices in the same position meet
+  // whenever their phases match modulo the shorter period
+  for( device = 0; device < MAX_DEVICES; device++ )
+  {
+    for( other = device + 1; other < MAX_DEVICES; other++ )
+    {
+      if( slot_schedule[device].position != slot_schedule[other].position )
+      {
+        continue;
+      }
+      
+      period = slot_schedule[device].period;
+      if( slot_schedule[other].period < period )
+      {
+        period = slot_schedule[other].period;
+      }
+      
+      if( ( slot_schedule[device].phase % period ) == 
+                                      ( slot_schedule[other].phase % period ) )
+      {
+        return 0;
+      }
+    }
+  }
+  
+  return 1;
+}
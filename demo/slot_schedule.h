@@ -0,0 +1,18 @@
+/** @file slot_schedule.h
+*
+* @brief Slot schedule shared by the access point and end devices
+*
+* @author Alvaro Prieto
+*/
+#ifndef _SLOT_SCHEDULE_H
+#define _SLOT_SCHEDULE_H
+
+#include "settings.h"
+#include "packets.h"
+
+// Slot position, period and phase of every device (see SLOT_SCHEDULE)
+extern const slot_schedule_t slot_schedule[];
+
+uint8_t slot_schedule_valid( void );
+
+#endif /* _SLOT_SCHEDULE_H */
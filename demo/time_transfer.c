@@ -0,0 +1,284 @@
+/** @file time_transfer.c
+*
+* @brief End device two-way time transfer. The device sends a request (its
+*         sync word leaves at t1, device time), the AP receives it at t2 and 
+*         answers (sync word leaves at t3, AP time), and the device receives
+*         the answer at t4. Then
+*
+*           offset = ( (t2 - t1) - (t4 - t3) ) / 2   AP time minus device time
+*           delay  = ( (t2 - t1) + (t4 - t3) ) / 2   one way
+*
+*         The AP can't put t3 in the answer it is sending, so it comes in the
+*         next answer and each exchange is completed one exchange late.
+*
+*         Timestamps are ticks plus a 1/TIMESTAMP_FRACTION fraction (see 
+*         radio_sync_fraction()). Without fine radio timestamps the fraction
+*         is always half a tick, which is where a plain capture lands on 
+*         average, so end devices (which can't use them) and the AP (which 
+*         does) can be mixed.
+*
+*         Offsets are collected for TIME_STATS_EXCHANGES exchanges, reported
+*         to the AP with the next requests and used to correct the time the
+*         timer is restarted at on every sync message. This owns the offset 
+*         between the device's and the AP's timer. The AP's slot offsets only
+*         handle what is left (like the device's own TX start delay), the end
+*         device takes every change of this correction out of its slot offset.
+*
+* @author Alvaro Prieto
+*/
+#include "time_transfer.h"
+
+// All timestamps are TA0R values, which count up to TIMER_LIMIT and wrap. 
+// They are kept in 1/TIMESTAMP_FRACTION ticks
+#define TIMER_PERIOD ( ( (int32_t)TIMER_LIMIT + 1 ) * TIMESTAMP_FRACTION )
+
+// Largest offset added to the statistics, so one bad exchange can't swamp 
+// the mean
+#define OFFSET_LIMIT ( INT16_MAX / TIME_STATS_EXCHANGES )
+
+static uint8_t cycles = 0; // Major cycles since the last request
+static uint8_t sequence = 0;
+
+// Exchange waiting for the AP to send its t3
+static uint8_t last_valid = 0;
+static uint8_t last_sequence;
+static int32_t last_t1;
+static int32_t last_t2;
+static int32_t last_t4;
+
+// Statistics being collected, in 1/TIME_SUBTICKS ticks
+static uint8_t exchanges = 0;
+static int16_t offset_min;
+static int16_t offset_max;
+static int16_t offset_sum = 0;
+static int16_t delay_sum = 0;
+
+// Last complete set of statistics, sent with every request
+static uint8_t report = 0;
+static uint8_t report_exchanges = 0;
+static int16_t report_offset_min = 0;
+static int16_t report_offset_max = 0;
+static int16_t report_offset_sum = 0;
+static int16_t report_delay_sum = 0;
+
+// Correction of the timer value to restart from when a sync message comes in
+static int16_t correction = 0;
+
+static int32_t timestamp( uint16_t, uint8_t );
+static int16_t timestamp_difference( int32_t, int32_t );
+static int16_t saturated_sum( int16_t, int16_t );
+static void exchange_done( int32_t, int32_t, int32_t, int32_t );
+
+/*******************************************************************************
+ * @fn     void time_transfer_cycle( void )
+ * @brief  Called once every major cycle
+ * ****************************************************************************/
+void time_transfer_cycle( void )
+{
+  if( cycles < TIME_TRANSFER_INTERVAL )
+  {
+    cycles++;
+  }
+}
+
+/*******************************************************************************
+ * @fn     uint8_t time_transfer_due( void )
+ * @brief  Returns 1 when it is time for another exchange
+ * ****************************************************************************/
+uint8_t time_transfer_due( void )
+{
+  return ( TIME_TRANSFER_INTERVAL > 0 ) && ( cycles >= TIME_TRANSFER_INTERVAL );
+}
+
+/*******************************************************************************
+ * @fn     void time_transfer_request( packet_time_request_t* request )
+ * @brief  Fill in a new request
+ * ****************************************************************************/
+void time_transfer_request( packet_time_request_t* request )
+{
+  cycles = 0;
+  sequence++;
+  
+  request->sequence = sequence;
+  request->report = report;
+  request->exchanges = report_exchanges;
+  request->offset_min = report_offset_min;
+  request->offset_max = report_offset_max;
+  request->offset_sum = report_offset_sum;
+  request->delay_sum = report_delay_sum;
+  request->correction = (int8_t)correction;
+}
+
+/*******************************************************************************
+ * @fn     void time_transfer_response( packet_time_response_t* response, 
+ *                uint16_t t1, uint8_t t1_fraction, uint16_t t4, 
+ *                                                        uint8_t t4_fraction )
+ * @brief  Handle the AP's answer to the last request. t1 is when the request
+ *         was sent and t4 when the answer was received
+ * ****************************************************************************/
+void time_transfer_response( packet_time_response_t* response, uint16_t t1, 
+                      uint8_t t1_fraction, uint16_t t4, uint8_t t4_fraction )
+{
+  // Late answer to an older request, the times don't belong together
+  if( response->sequence != sequence )
+  {
+    return;
+  }
+  
+  if( last_valid && ( response->last_sequence == last_sequence ) )
+  {
+    exchange_done( last_t1, last_t2, timestamp( response->last_response_time, 
+                              response->last_response_fraction ), last_t4 );
+  }
+  
+  last_valid = 1;
+  last_sequence = response->sequence;
+  last_t1 = timestamp( t1, t1_fraction );
+  last_t2 = timestamp( response->request_time, response->request_fraction );
+  last_t4 = timestamp( t4, t4_fraction );
+}
+
+/*******************************************************************************
+ * @fn     int16_t time_transfer_correction( void )
+ * @brief  Ticks to add to the timer value restarted from when a sync message 
+ *         comes in, so the timer matches the AP's
+ * ****************************************************************************/
+int16_t time_transfer_correction( void )
+{
+  return correction;
+}
+
+/*******************************************************************************
+ * @fn     void exchange_done( int32_t t1, int32_t t2, int32_t t3, int32_t t4 )
+ * @brief  Add the results of a complete exchange to the statistics
+ * ****************************************************************************/
+static void exchange_done( int32_t t1, int32_t t2, int32_t t3, int32_t t4 )
+{
+  int16_t uplink;
+  int16_t downlink;
+  int16_t offset;
+  int16_t delay;
+  
+  uplink = timestamp_difference( t2, t1 );
+  downlink = timestamp_difference( t4, t3 );
+  
+  // Halving the sum and difference is where the extra resolution bit goes
+  offset = ( (int32_t)uplink - downlink ) / 2;
+  delay = ( (int32_t)uplink + downlink ) / 2;
+  
+  if( offset > OFFSET_LIMIT )
+  {
+    offset = OFFSET_LIMIT;
+  }
+  else if( offset < -OFFSET_LIMIT )
+  {
+    offset = -OFFSET_LIMIT;
+  }
+  
+  if( ( 0 == exchanges ) || ( offset < offset_min ) )
+  {
+    offset_min = offset;
+  }
+  
+  if( ( 0 == exchanges ) || ( offset > offset_max ) )
+  {
+    offset_max = offset;
+  }
+  
+  offset_sum = saturated_sum( offset_sum, offset );
+  delay_sum = saturated_sum( delay_sum, delay );
+  exchanges++;
+  
+  if( exchanges < TIME_STATS_EXCHANGES )
+  {
+    return;
+  }
+  
+  report++;
+  report_exchanges = exchanges;
+  report_offset_min = offset_min;
+  report_offset_max = offset_max;
+  report_offset_sum = offset_sum;
+  report_delay_sum = delay_sum;
+  
+  // Move the restart time by the mean offset, rounded to whole ticks
+  correction += ( (int32_t)offset_sum + ( offset_sum >= 0 ? 1 : -1 ) * 
+          ( exchanges * TIME_SUBTICKS / 2 ) ) / ( exchanges * TIME_SUBTICKS );
+  if( correction > TIME_CORRECTION_MAX )
+  {
+    correction = TIME_CORRECTION_MAX;
+  }
+  else if( correction < -TIME_CORRECTION_MAX )
+  {
+    correction = -TIME_CORRECTION_MAX;
+  }
+  
+  exchanges = 0;
+  offset_sum = 0;
+  delay_sum = 0;
+}
+
+/*******************************************************************************
+ * @fn     int32_t timestamp( uint16_t ticks, uint8_t fraction )
+ * @brief  Combine a TA0R value and its sub-tick part
+ * ****************************************************************************/
+static int32_t timestamp( uint16_t ticks, uint8_t fraction )
+{
+  return (int32_t)ticks * TIMESTAMP_FRACTION + fraction;
+}
+
+/*******************************************************************************
+ * @fn     int16_t timestamp_difference( int32_t later, int32_t earlier )
+ * @brief  later - earlier in 1/TIME_SUBTICKS ticks, taking timer wraps into
+ *         account
+ * ****************************************************************************/
+static int16_t timestamp_difference( int32_t later, int32_t earlier )
+{
+  int32_t difference;
+  
+  difference = later - earlier;
+  
+  if( difference > ( TIMER_PERIOD / 2 ) )
+  {
+    difference -= TIMER_PERIOD;
+  }
+  else if( difference < -( TIMER_PERIOD / 2 ) )
+  {
+    difference += TIMER_PERIOD;
+  }
+  
+  difference /= ( TIMESTAMP_FRACTION / TIME_SUBTICKS );
+  
+  if( difference > INT16_MAX )
+  {
+    difference = INT16_MAX;
+  }
+  else if( difference < INT16_MIN )
+  {
+    difference = INT16_MIN;
+  }
+  
+  return (int16_t)difference;
+}
+
+/*******************************************************************************
+ * @fn     int16_t saturated_sum( int16_t sum, int16_t value )
+ * @brief  sum + value, held at INT16_MIN/INT16_MAX instead of wrapping
+ * ****************************************************************************/
+static int16_t saturated_sum( int16_t sum, int16_t value )
+{
+  int32_t result;
+  
+  result = (int32_t)sum + value;
+  
+  if( result > INT16_MAX )
+  {
+    result = INT16_MAX;
+  }
+  else if( result < INT16_MIN )
+  {
+    result = INT16_MIN;
+  }
+  
+  return (int16_t)result;
+}
@@ -0,0 +1,21 @@
+/** @file time_transfer.h
+*
+* @brief End device two-way time transfer with the access point
+*
+* @author Alvaro Prieto
+*/
+#ifndef _TIME_TRANSFER_H
+#define _TIME_TRANSFER_H
+
+#include "settings.h"
+#include "packets.h"
+#include "timestamp.h"
+
+void time_transfer_cycle( void );
+uint8_t time_transfer_due( void );
+void time_transfer_request( packet_time_request_t* );
+void time_transfer_response( packet_time_response_t*, uint16_t, uint8_t, 
+                                                  uint16_t, uint8_t );
+int16_t time_transfer_correction( void );
+
+#endif /* _TIME_TRANSFER_H */
@@ -5,19 +5,62 @@
 * @author Alvaro Prieto
 */
 #include "radio.h"
+#include "intrinsics.h"
+#include "timers.h"
+#include "timestamp.h"
 #include <signal.h>
 
 static uint8_t dummy_callback( uint8_t*, uint8_t );
 inline void tx_done( void );
 inline void rx_enable();
 inline void rx_disable();
+static inline void window_enable();
+static inline uint8_t window_resume();
+static inline void tx_load( uint8_t*, uint8_t );
+static inline uint16_t sync_capture_time( void );
 
 // Receive buffer
 static uint8_t rx_buffer[RX_BUFFER_SIZE];
 
+// Sync words used for each network id. The first one is the radio default.
+// All are DC balanced, have no runs longer than 3 bits and differ from each
+// other in at least 6 bits, so the 30/32 sync word check rejects the others
+static const uint16_t network_sync_words[TOTAL_NETWORKS] = {
+  0xD391, 0x1177, 0x12DB, 0x13AD, 0x14EE, 0x173A, 0x19DC, 0x1C97
+};
+
 // Radio mode holds whether or not radio is transmitting or receiving
 volatile uint8_t radio_mode = RADIO_RX;
 
+// Whether the receiver is turned back on after transmitting or receiving
+static volatile uint8_t listen = LISTEN_ON;
+
+// Set when the RX callback accepts a frame received during an RX window, see
+// radio_window_accept()
+static volatile uint8_t window_heard;
+
+// Time left in the current RX window (in ticks) as of when the receiver was
+// last started, its flags, and whether it still has to be opened after a 
+// transmission
+static uint16_t window_ticks;
+static uint16_t window_start;
+static uint8_t window_flags;
+static volatile uint8_t window_pending = 0;
+
+// TA0R when the sync word of the last transmitted frame went out
+static volatile uint16_t tx_sync_time;
+
+// Where captures from before a TX or RX start are thrown away
+static uint16_t stale_capture;
+
+// Sub-tick parts of the sync word timestamps, see radio_fine_timestamps()
+static volatile uint8_t fine_timestamps = 0;
+static volatile uint8_t rx_sync_fraction = TIMESTAMP_FRACTION / 2;
+static volatile uint8_t tx_sync_fraction = TIMESTAMP_FRACTION / 2;
+
+// Receive statistics, collected by the radio ISR until read
+static volatile radio_status_t rx_status;
+
 extern RF_SETTINGS rfSettings;
 
 // Holds pointers to all callback functions for CCR registers (and overflow)
@@ -45,28 +88,130 @@ void setup_radio( uint8_t (*callback)(uint8_t*, uint8_t) )
   
   WriteRfSettings(&rfSettings);
   
+  // Timestamp sync words in hardware, see sync_capture_time()
+  WriteSingleReg( IOCFG1, GDO_SYNC_WORD );
+  setup_capture( RADIO_CAPTURE_CCR );
+  
   WriteSinglePATable(PATABLE_VAL);
 
   rx_enable();
 }
 
+/*******************************************************************************
+ * @fn     uint8_t radio_set_network( uint8_t network_id, uint8_t max_length )
+ * @brief  Only accept packets from network [network_id] that are at most
+ *         [max_length] bytes long (not counting the length byte). Other
+ *         networks' sync words don't match, so their packets never interrupt
+ *         the CPU. Longer packets still raise the sync word interrupt before
+ *         the radio drops them, the ISR then finds the FIFO empty. Returns 0
+ *         and changes nothing if [network_id] isn't below TOTAL_NETWORKS
+ * ****************************************************************************/
+uint8_t radio_set_network( uint8_t network_id, uint8_t max_length )
+{
+  uint16_t sync_word;
+  
+  if( network_id >= TOTAL_NETWORKS )
+  {
+    return 0;
+  }
+  
+  sync_word = network_sync_words[network_id];
+  
+  // Registers should only be changed while idle
+  if( RADIO_RX == radio_mode )
+  {
+    rx_disable();
+  }
+  
+  WriteSingleReg( SYNC1, (uint8_t)(sync_word >> 8) );
+  WriteSingleReg( SYNC0, (uint8_t)(sync_word & 0xFF) );
+  WriteSingleReg( PKTLEN, max_length );
+  
+  if( ( LISTEN_ON == listen ) && ( RADIO_TX != radio_mode ) )
+  {
+    rx_enable();
+  }
+  
+  return 1;
+}
+
 /*******************************************************************************
  * @fn     void radio_tx( uint8_t* buffer, uint8_t size )
  * @brief  Send message through radio
  * ****************************************************************************/
 void radio_tx( uint8_t* buffer, uint8_t size )
+{
+  tx_load( buffer, size );
+  
+  Strobe( RF_STX ); // Strobe STX
+  
+}
+
+/*******************************************************************************
+ * @fn     void radio_tx_prepare( uint8_t* buffer, uint8_t size )
+ * @brief  Load a message and calibrate the synthesizer ahead of time, so
+ *         radio_tx_start() only has to strobe STX. Nothing is received until
+ *         the message has been sent
+ * ****************************************************************************/
+void radio_tx_prepare( uint8_t* buffer, uint8_t size )
+{
+  tx_load( buffer, size );
+  
+  // Calibrates (~800us) and waits in FSTXON, ready to transmit
+  Strobe( RF_SFSTXON );
+}
+
+/*******************************************************************************
+ * @fn     void radio_tx_start( )
+ * @brief  Send the message loaded by radio_tx_prepare(). Short enough to be
+ *         called right at a timer event
+ * ****************************************************************************/
+void radio_tx_start()
+{
+  while( !(RF1AIFCTL1 & RFINSTRIFG) );
+  RF1AINSTRB = RF_STX;
+}
+
+/*******************************************************************************
+ * @fn     void tx_load( uint8_t* buffer, uint8_t size )
+ * @brief  Get ready to transmit and write the message into the TX FIFO
+ * ****************************************************************************/
+static inline void tx_load( uint8_t* buffer, uint8_t size )
 {
   rx_disable();
   radio_mode = RADIO_TX;
     
-  RF1AIES |= BIT9;
+  RF1AIES &= ~BIT9; // Rising edge of RFIFG9 (sync word sent)
   RF1AIFG &= ~BIT9; // Clear pending interrupts
-  RF1AIE |= BIT9; // Enable TX end-of-packet interrupt
+  read_capture( RADIO_CAPTURE_CCR, &stale_capture ); // And old captures
+  if( fine_timestamps )
+  {
+    timestamp_discard();
+  }
+  RF1AIE |= BIT9; // Enable the interrupt
   
+  // Drop anything left over from a frame that was cut short (or underflowed)
+  Strobe( RF_SFTX );
   WriteBurstReg(RF_TXFIFOWR, buffer, size);
+}
+
+/*******************************************************************************
+ * @fn     uint16_t sync_capture_time( void )
+ * @brief  Timer count when the sync word being handled was sent or received.
+ *         Captured by the timer when GDO1 rises, so it doesn't depend on how
+ *         long it took to get into the ISR. Falls back to the current count 
+ *         if the capture is missing or was overwritten
+ * ****************************************************************************/
+static inline uint16_t sync_capture_time( void )
+{
+  uint16_t count;
   
-  Strobe( RF_STX ); // Strobe STX
+  if( !read_capture( RADIO_CAPTURE_CCR, &count ) )
+  {
+    count = timer_now();
+  }
   
+  return count;
 }
 
 /*******************************************************************************
@@ -75,9 +220,183 @@ void radio_tx( uint8_t* buffer, uint8_t size )
  * ****************************************************************************/
 inline void tx_done( )
 {
+  if( LISTEN_ON == listen )
+  {
+    rx_enable();
+  }
+  else if( window_pending )
+  {
+    // Window was asked for while transmitting
+    window_pending = 0;
+    window_enable();
+  }
+  else
+  {
+    radio_mode = RADIO_IDLE;
+  }
+}
+
+/*******************************************************************************
+ * @fn     void radio_listen( uint8_t enable )
+ * @brief  Turn the receiver on or off. While off, the radio stays idle after
+ *         transmitting
+ * ****************************************************************************/
+void radio_listen( uint8_t enable )
+{
+  uint8_t new_listen;
+  
+  new_listen = enable ? LISTEN_ON : LISTEN_OFF;
+  
+  if( new_listen == listen )
+  {
+    return;
+  }
+  
+  listen = new_listen;
+  window_pending = 0;
+  
+  if( LISTEN_ON == listen )
+  {
+    // No RX timeout, stay in RX until told otherwise
+    WriteSingleReg( MCSM2, RX_TIME_NONE );
+  }
+  
+  // A transmission in progress will take care of it when done
+  if( radio_mode == RADIO_TX )
+  {
+    return;
+  }
+  
+  rx_disable();
+  
+  if( LISTEN_ON == listen )
+  {
+    rx_enable();
+  }
+}
+
+/*******************************************************************************
+ * @fn     void radio_rx_window( uint16_t ticks, uint8_t flags )
+ * @brief  Turn the receiver on for at most [ticks] ACLK ticks. The radio ends
+ *         the window by itself if no sync word is found in time. With
+ *         RX_WINDOW_CARRIER set, it also ends early if there is no carrier.
+ *         The window only ends early when the RX callback accepts a frame
+ *         with radio_window_accept(), the receiver is restarted for the rest
+ *         of the window after anything else. It stays off after the window, 
+ *         use radio_window_empty() to find out whether a frame was accepted.
+ *         If called while transmitting, the window opens once the 
+ *         transmission is done
+ * ****************************************************************************/
+void radio_rx_window( uint16_t ticks, uint8_t flags )
+{
+  if( ticks > RX_WINDOW_MAX )
+  {
+    ticks = RX_WINDOW_MAX;
+  }
+  
+  window_ticks = ticks;
+  window_flags = flags;
+  
+  listen = LISTEN_WINDOW;
+  window_heard = 0;
+  
+  if( RADIO_TX == radio_mode )
+  {
+    window_pending = 1;
+    return;
+  }
+  
+  rx_disable();
+  window_enable();
+}
+
+/*******************************************************************************
+ * @fn     void window_enable( )
+ * @brief  Set up the RX timeout for the current window and start receiving
+ * ****************************************************************************/
+static inline void window_enable()
+{
+  uint16_t event0;
+  
+  // With WOR_RES = 0 and RX_TIME = 0 the RX timeout is EVENT0 * 3.6058us,
+  // which is ~8.463 counts per 30.518us ACLK tick
+  event0 = (uint16_t)( ( (uint32_t)window_ticks * 8463 ) / 1000 );
+  
+  WriteSingleReg( WORCTRL, WORCTRL_RX_WINDOW );
+  WriteSingleReg( WOREVT1, (uint8_t)(event0 >> 8) );
+  WriteSingleReg( WOREVT0, (uint8_t)(event0 & 0xFF) );
+  WriteSingleReg( MCSM2, ( window_flags & RX_WINDOW_CARRIER ) | RX_TIME_WINDOW );
+  
+  window_start = timer_now();
   rx_enable();
 }
 
+/*******************************************************************************
+ * @fn     uint8_t window_resume( )
+ * @brief  Restart the receiver for what is left of the current RX window after
+ *         a frame that wasn't accepted. Returns 0 if the window is over
+ * ****************************************************************************/
+static inline uint8_t window_resume()
+{
+  uint16_t now;
+  uint16_t elapsed;
+  
+  now = timer_now();
+  elapsed = now - window_start;
+  if( now < window_start )
+  {
+    // Timer0_A runs in up mode, wrapping after TA0CCR0
+    elapsed += TA0CCR0 + 1;
+  }
+  
+  if( elapsed >= window_ticks )
+  {
+    return 0;
+  }
+  
+  window_ticks -= elapsed;
+  window_enable();
+  
+  return 1;
+}
+
+/*******************************************************************************
+ * @fn     void radio_window_accept( )
+ * @brief  Called from the RX callback when the frame is the one the current RX
+ *         window was opened for. The window ends with it
+ * ****************************************************************************/
+void radio_window_accept()
+{
+  if( LISTEN_WINDOW == listen )
+  {
+    window_heard = 1;
+  }
+}
+
+/*******************************************************************************
+ * @fn     uint8_t radio_window_empty( )
+ * @brief  Returns 1 once if the last RX window was closed by the radio without
+ *         an accepted frame, 0 otherwise (still open, or a frame accepted)
+ * ****************************************************************************/
+uint8_t radio_window_empty()
+{
+  if( ( LISTEN_WINDOW != listen ) || window_heard )
+  {
+    return 0;
+  }
+  
+  // Radio drops back to IDLE by itself when the RX timeout expires
+  if( MARCSTATE_IDLE != ( ReadSingleReg( MARCSTATE ) & MARCSTATE_MASK ) )
+  {
+    return 0;
+  }
+  
+  listen = LISTEN_OFF;
+  rx_disable();
+  
+  return 1;
+}
+
 
 /*******************************************************************************
  * @fn     rx_enable( )
@@ -87,8 +406,13 @@ inline void rx_enable()
 {
   radio_mode = RADIO_RX;
 
-  RF1AIES |= BIT9; // Falling edge of RFIFG9
+  RF1AIES &= ~BIT9; // Rising edge of RFIFG9 (sync word received)
   RF1AIFG &= ~BIT9; // Clear a pending interrupt
+  read_capture( RADIO_CAPTURE_CCR, &stale_capture ); // And old captures
+  if( fine_timestamps )
+  {
+    timestamp_discard();
+  }
   RF1AIE |= BIT9; // Enable the interrupt
   
   // Radio is in IDLE following a TX, so strobe SRX to enter Receive Mode
@@ -101,6 +425,8 @@ inline void rx_enable()
  * ****************************************************************************/
 inline void rx_disable()
 {
+  radio_mode = RADIO_IDLE;
+  
   RF1AIE &= ~BIT9; // Disable RX interrupts
   RF1AIFG &= ~BIT9; // Clear pending IFG  // Increase PMMCOREV level to 2 for proper radio operation
   SetVCore(2);
@@ -112,6 +438,107 @@ inline void rx_disable()
   Strobe( RF_SFRX );
 }
 
+/*******************************************************************************
+ * @fn     void radio_read_status( radio_status_t* status )
+ * @brief  Copy the receive statistics collected since the last call and
+ *         clear them
+ * ****************************************************************************/
+void radio_read_status( radio_status_t* status )
+{
+  uint16_t interrupt_state;
+  
+  interrupt_state = __get_interrupt_state();
+  dint();
+  
+  *status = rx_status;
+  
+  rx_status.syncs = 0;
+  rx_status.frames = 0;
+  rx_status.crc_errors = 0;
+  
+  __set_interrupt_state( interrupt_state );
+}
+
+/*******************************************************************************
+ * @fn     uint16_t radio_sync_time( )
+ * @brief  TA0R value when the sync word of the last frame was received. When
+ *         called from the rx callback, this belongs to the frame being handled
+ * ****************************************************************************/
+uint16_t radio_sync_time()
+{
+  return rx_status.sync_time;
+}
+
+/*******************************************************************************
+ * @fn     uint16_t radio_tx_sync_time( )
+ * @brief  TA0R value when the sync word of the last transmitted frame went out
+ * ****************************************************************************/
+uint16_t radio_tx_sync_time()
+{
+  return tx_sync_time;
+}
+
+/*******************************************************************************
+ * @fn     void radio_fine_timestamps( uint8_t enable )
+ * @brief  Timestamp sync words to a fraction of a tick, with TA1 running from
+ *         SMCLK (see timestamp.c). Only for devices that don't use TA1 and 
+ *         don't sleep deeper than LPM0. Busy waits for a few ticks when 
+ *         enabled, to calibrate
+ * ****************************************************************************/
+void radio_fine_timestamps( uint8_t enable )
+{
+  if( enable )
+  {
+    timestamp_start();
+  }
+  else if( fine_timestamps )
+  {
+    timestamp_stop();
+  }
+  
+  fine_timestamps = enable;
+  rx_sync_fraction = TIMESTAMP_FRACTION / 2;
+  tx_sync_fraction = TIMESTAMP_FRACTION / 2;
+}
+
+/*******************************************************************************
+ * @fn     uint8_t radio_sync_fraction( )
+ * @brief  How far past the middle of the tick before radio_sync_time() the 
+ *         sync word was received, in 1/TIMESTAMP_FRACTION ticks. Always 
+ *         TIMESTAMP_FRACTION / 2 without fine timestamps
+ * ****************************************************************************/
+uint8_t radio_sync_fraction()
+{
+  return rx_sync_fraction;
+}
+
+/*******************************************************************************
+ * @fn     uint8_t radio_tx_sync_fraction( )
+ * @brief  Same as radio_sync_fraction(), for radio_tx_sync_time()
+ * ****************************************************************************/
+uint8_t radio_tx_sync_fraction()
+{
+  return tx_sync_fraction;
+}
+
+/*******************************************************************************
+ * @fn     uint8_t radio_transmitting( )
+ * @brief  Returns 1 until the frame passed to radio_tx() has been sent
+ * ****************************************************************************/
+uint8_t radio_transmitting()
+{
+  return ( RADIO_TX == radio_mode );
+}
+
+/*******************************************************************************
+ * @fn     int8_t radio_rssi( )
+ * @brief  Read the current (raw) RSSI value from the radio. Only valid in RX
+ * ****************************************************************************/
+int8_t radio_rssi()
+{
+  return (int8_t)ReadSingleReg( RSSI );
+}
+
 /*******************************************************************************
  * @fn     void dummy_callback( void )
  * @brief  empty function works as default callback
@@ -130,7 +557,9 @@ static uint8_t dummy_callback( uint8_t* buffer, uint8_t size )
 wakeup interrupt (CC1101_VECTOR) radio_isr (void)
 {
   uint16_t vector_flag;
+  uint16_t masked;
   uint8_t rx_message_size;
+  uint8_t rx_bytes;
   //
   // NOTE: For some reason, the switch statement with argument RF1AIV does not
   // work. Adding the temporary variable 'vector_flag' fixes the problem
@@ -153,31 +582,107 @@ wakeup interrupt (CC1101_VECTOR) radio_isr (void)
     case RF1AIV_RFIFG9: // RFIFG9
     {
       
-      if(radio_mode == RADIO_RX) 
+      if( (radio_mode == RADIO_RX) && !(RF1AIES & BIT9) )
       {
-        // Read the length byte from the FIFO
-        rx_message_size = ReadSingleReg( RXBYTES );
-        ReadBurstReg(RF_RXFIFORD, rx_buffer, rx_message_size);
+        // Rising edge, sync word was just received. Timestamp it and wait
+        // for the end of the packet
+        rx_status.sync_time = sync_capture_time();
+        if( fine_timestamps )
+        {
+          rx_sync_fraction = timestamp_fraction();
+        }
+        rx_status.syncs++;
         
-        // Stop here to see contents of RxBuffer
-        __no_operation();
+        RF1AIES |= BIT9; // Falling edge of RFIFG9 (end of packet)
+        RF1AIFG &= ~BIT9; // Changing the edge might set the flag
+      }
+      else if(radio_mode == RADIO_RX) 
+      {
+        // Reading the FIFO and running the callback takes a while, let the
+        // preemptive timer interrupt (sampling) in meanwhile. RFIFG9 is
+        // masked so this ISR can't be re-entered
+        RF1AIE &= ~BIT9;
+        masked = timer_allow_preemption();
         
-        // Check the CRC results
-        if(rx_buffer[rx_message_size + CRC_LQI_IDX_OFFSET] & CRC_OK)
+        // Bytes in the FIFO, the length byte and status bytes included. It's 
+        // empty if the packet was dropped for being too long, and has to be
+        // flushed after an overflow
+        rx_bytes = ReadSingleReg( RXBYTES );
+        rx_message_size = rx_bytes & RXBYTES_COUNT;
+        
+        if( ( rx_bytes & RXBYTES_OVERFLOW ) || 
+            ( rx_message_size < RX_FRAME_MIN ) || 
+            ( rx_message_size > RX_BUFFER_SIZE ) )
+        {
+          Strobe( RF_SIDLE );
+          Strobe( RF_SFRX );
+        }
+        else
         {
-          if ( rx_callback(rx_buffer, rx_message_size) )
+          ReadBurstReg(RF_RXFIFORD, rx_buffer, rx_message_size);
+          
+          // Stop here to see contents of RxBuffer
+          __no_operation();
+          
+          rx_status.rssi = 
+                      (int8_t)rx_buffer[rx_message_size + RSSI_IDX_OFFSET];
+          
+          // Check the CRC results
+          if(rx_buffer[rx_message_size + CRC_LQI_IDX_OFFSET] & CRC_OK)
           {
-            // If callback function returns 1, wake up after interrupt
-            // Otherwise, stay in whatever mode it is in.
-            __bic_SR_register_on_exit(LPM3_bits);
+            rx_status.frames++;
+            
+            if ( rx_callback(rx_buffer, rx_message_size) )
+            {
+              // If callback function returns 1, wake up after interrupt
+              // Otherwise, stay in whatever mode it is in.
+              __bic_SR_register_on_exit(LPM3_bits);
+            }
+                      
+          }
+          else
+          {
+            rx_status.crc_errors++;
           }
-                    
         }
         
+        timer_end_preemption( masked );
+        
         // Not sure why this is needed, but it fixes a problem of not
         // receiving messages after the first one comes in
-        rx_enable();
+        if( LISTEN_ON == listen )
+        {
+          rx_enable();
+        }
+        else if( ( LISTEN_WINDOW == listen ) && !window_heard && 
+                                                            window_resume() )
+        {
+          // Not what the window was for, keep listening
+        }
+        else
+        {
+          // Radio is idle after a packet. An RX window ends with an accepted
+          // one, or stays open (and empty) if it timed out meanwhile
+          radio_mode = RADIO_IDLE;
+          if( window_heard )
+          {
+            listen = LISTEN_OFF;
+          }
+        }
+        
+      }
+      else if( (radio_mode == RADIO_TX) && !(RF1AIES & BIT9) )
+      {
+        // Rising edge, sync word was just sent. Timestamp it and wait for
+        // the end of the packet
+        tx_sync_time = sync_capture_time();
+        if( fine_timestamps )
+        {
+          tx_sync_fraction = timestamp_fraction();
+        }
         
+        RF1AIES |= BIT9; // Falling edge of RFIFG9 (end of packet)
+        RF1AIFG &= ~BIT9; // Changing the edge might set the flag
       }
       else if(radio_mode == RADIO_TX)
       {
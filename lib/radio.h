@@ -16,13 +16,52 @@
 #define RSSI_IDX_OFFSET (-2) // Index of appended RSSI
 #define CRC_LQI_IDX_OFFSET (-1) // Index of appended LQI, checksum
 #define CRC_OK (BIT7) // CRC_OK bit
+#define RSSI_OFFSET (74) // RSSI offset in dBm (see CC430 datasheet)
+#define RSSI_RAW(dbm) (((dbm) + RSSI_OFFSET) * 2) // dBm to raw RSSI value
 #define PATABLE_VAL (0x51) // 0 dBm output
 
 #define RADIO_RX 0
 #define RADIO_TX 1
+#define RADIO_IDLE 2
+
+// Receiver states between packets
+#define LISTEN_OFF 0
+#define LISTEN_ON 1
+#define LISTEN_WINDOW 2 // RX window with a timeout, see radio_rx_window()
+
+// MCSM2/WORCTRL settings for RX windows
+#define RX_WINDOW_CARRIER (BIT4) // MCSM2.RX_TIME_RSSI, stop early if no carrier
+#define RX_TIME_WINDOW (0x00) // Timeout after EVENT0 * 3.6058us
+#define RX_TIME_NONE (0x07) // Wait for sync word forever (default)
+#define WORCTRL_RX_WINDOW (0xF8) // Default WORCTRL, except WOR_RES = 0
+#define RX_WINDOW_MAX (7700) // Longest RX window in ticks (EVENT0 <= 0xFFFF)
+
+#define MARCSTATE_MASK (0x1F)
+#define MARCSTATE_IDLE (0x01)
 
 #define RX_BUFFER_SIZE 255
 
+#define RXBYTES_OVERFLOW (BIT7) // RXBYTES.RXFIFO_OVERFLOW
+#define RXBYTES_COUNT (0x7F) // RXBYTES.NUM_RXBYTES
+#define RX_FRAME_MIN (3) // Length byte and the appended RSSI and LQI
+
+#define TOTAL_NETWORKS 8 // Number of distinct network sync words
+
+// GDO1 follows the sync word signal (like RFIFG9) and is captured by this TA0
+// CCR, which can't be used for anything else
+#define GDO_SYNC_WORD (0x06) // IOCFG1 value, sync word sent/received
+#define RADIO_CAPTURE_CCR (3)
+
+// Receive statistics collected by the radio ISR
+typedef struct
+{
+  uint8_t syncs;        // Sync words detected
+  uint8_t frames;       // Frames received with a good CRC
+  uint8_t crc_errors;   // Frames received with a bad CRC
+  int8_t rssi;          // Raw RSSI of the last frame received
+  uint16_t sync_time;   // TA0R value when the last sync word was detected
+} radio_status_t;
+
 // Packet type and flag definitions
 // Should have some structure eventually, but assigning arbitrary values for now
 
@@ -30,9 +69,32 @@
 #define REPEATER_FLAG (1 << 2)
 
 #define POWER_PACKET (0x05)
+#define SYNC_PACKET (0x66)
+#define SAMPLES_PACKET (0xAA)
+#define SLOT_STATS_PACKET (0x53)
+#define BURST_PACKET (0xB5)
+#define TIME_REQUEST_PACKET (0x71)
+#define TIME_RESPONSE_PACKET (0x72)
+#define FLOW_DROPS_PACKET (0xD7)
+#define COMMAND_NAK_PACKET (0x15)
 
 void setup_radio( uint8_t (*)(uint8_t*, uint8_t) );
 void radio_tx( uint8_t*, uint8_t );
+void radio_tx_prepare( uint8_t*, uint8_t );
+void radio_tx_start();
+void radio_listen( uint8_t );
+void radio_rx_window( uint16_t, uint8_t );
+void radio_window_accept();
+uint8_t radio_window_empty();
+uint8_t radio_set_network( uint8_t, uint8_t );
+void radio_read_status( radio_status_t* );
+int8_t radio_rssi();
+uint16_t radio_sync_time();
+uint16_t radio_tx_sync_time();
+void radio_fine_timestamps( uint8_t );
+uint8_t radio_sync_fraction();
+uint8_t radio_tx_sync_fraction();
+uint8_t radio_transmitting();
 
 
 #endif /* _RADIO_H */\
@@ -0,0 +1,150 @@
+/** @file sample_timer.c
+*
+* @brief Sample timer functions. Timer1_A runs continuously from ACLK and is
+*         never stopped or cleared, CCR0 calls the sample callback at the
+*         sample rate. Sample periods alternate between whole numbers of ticks
+*         so the average rate is exact. The sample phase can only be moved 
+*         gradually, a little every period.
+*
+* @author Alvaro Prieto
+*/
+#include "sample_timer.h"
+#include "intrinsics.h"
+#include <signal.h>
+
+static uint8_t dummy_callback( void );
+
+static uint8_t (*sample_callback)( void ) = dummy_callback;
+
+static uint16_t sample_rate;
+static uint16_t period_ticks; // Whole part of the period
+static uint16_t period_remainder; // Fractional part, in 1/sample_rate ticks
+
+// Fractional part of the next sample time, in 1/sample_rate ticks
+static int16_t phase = 0;
+
+// Phase correction still to be applied, and the most applied per period,
+// in 1/sample_rate ticks
+static int32_t slew = 0;
+static int16_t slew_step;
+
+/*******************************************************************************
+ * @fn     void setup_sample_timer( uint16_t rate, uint8_t (*callback)(void) )
+ * @brief  Start calling [callback] [rate] times per second. It runs in the 
+ *         Timer1_A CCR0 ISR, if it returns 1 the CPU wakes up afterwards
+ * ****************************************************************************/
+void setup_sample_timer( uint16_t rate, uint8_t (*callback)(void) )
+{
+  sample_rate = rate;
+  period_ticks = SAMPLE_TIMER_CLOCK / rate;
+  period_remainder = SAMPLE_TIMER_CLOCK % rate;
+  
+  slew_step = rate / SAMPLE_SLEW_DIVIDER;
+  if( 0 == slew_step )
+  {
+    slew_step = 1;
+  }
+  
+  sample_callback = callback;
+  
+  // ACLK, continuous mode, clear TAR
+  TA1CTL = TASSEL__ACLK + MC_2 + TACLR;
+  TA1CCR0 = period_ticks;
+  TA1CCTL0 = CCIE;
+}
+
+/*******************************************************************************
+ * @fn     uint16_t sample_timer_now( void )
+ * @brief  Current sample timer count
+ * ****************************************************************************/
+uint16_t sample_timer_now( void )
+{
+  uint16_t count;
+  
+  // Timer runs from ACLK, asynchronous to the CPU. Read until two agree
+  do
+  {
+    count = TA1R;
+  } while( count != TA1R );
+  
+  return count;
+}
+
+/*******************************************************************************
+ * @fn     void sample_timer_align( uint16_t reference )
+ * @brief  Start moving the sample phase so samples fall on [reference] (a 
+ *         sample timer count) plus a whole number of sample periods
+ * ****************************************************************************/
+void sample_timer_align( uint16_t reference )
+{
+  uint16_t interrupt_state;
+  int32_t error;
+  
+  interrupt_state = __get_interrupt_state();
+  dint();
+  
+  // How far the next sample is past a sample time lined up with reference.
+  // One period is SAMPLE_TIMER_CLOCK in units of 1/sample_rate ticks, and
+  // the count wrapping around (65536 ticks) is a whole number of periods
+  error = ( (int32_t)(uint16_t)( TA1CCR0 - reference ) * sample_rate + phase ) 
+                                                        % SAMPLE_TIMER_CLOCK;
+  if( error > ( SAMPLE_TIMER_CLOCK / 2 ) )
+  {
+    error -= SAMPLE_TIMER_CLOCK;
+  }
+  
+  slew = -error;
+  
+  __set_interrupt_state( interrupt_state );
+}
+
+/*******************************************************************************
+ * @fn     void dummy_callback( void )
+ * @brief  empty function works as default callback
+ * ****************************************************************************/
+static uint8_t dummy_callback( void )
+{
+  __no_operation();
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn     void sample_timer_isr( void )
+ * @brief  Timer1 A0 Interrupt vector for CCR0. Calls the sample callback and
+ *         schedules the next sample
+ * ****************************************************************************/
+interrupt (TIMER1_A0_VECTOR) sample_timer_isr(void)
+{
+  uint16_t period;
+  int16_t step;
+  
+  if( sample_callback() )
+  {
+    __bic_SR_register_on_exit(LPM3_bits);
+  }
+  
+  step = slew_step;
+  if( slew < step )
+  {
+    step = ( slew > -step ) ? (int16_t)slew : -step;
+  }
+  slew -= step;
+  
+  // Carry the fractional part of the period (and the phase correction),
+  // adding or removing a tick whenever it adds up to a whole one
+  period = period_ticks;
+  phase += period_remainder + step;
+  while( phase >= (int16_t)sample_rate )
+  {
+    phase -= sample_rate;
+    period++;
+  }
+  while( phase < 0 )
+  {
+    phase += sample_rate;
+    period--;
+  }
+  
+  TA1CCR0 += period;
+}
@@ -0,0 +1,22 @@
+/** @file sample_timer.h
+*
+* @brief Sample timer functions (Timer1_A)
+*
+* @author Alvaro Prieto
+*/
+#ifndef _SAMPLE_TIMER_H
+#define _SAMPLE_TIMER_H
+
+#include "common.h"
+
+#define SAMPLE_TIMER_CLOCK (32768) // ACLK frequency in Hz
+
+// Phase corrections are spread out, at most 1/SAMPLE_SLEW_DIVIDER of a tick
+// per sample period
+#define SAMPLE_SLEW_DIVIDER (8)
+
+void setup_sample_timer( uint16_t, uint8_t (*)(void) );
+uint16_t sample_timer_now( void );
+void sample_timer_align( uint16_t );
+
+#endif /* _SAMPLE_TIMER_H */
@@ -0,0 +1,99 @@
+/** @file stack.c
+*
+* @brief Stack usage measurement. The stack grows down from __stack towards 
+*         the end of the static data (_end), both provided by the linker.
+*         stack_paint() fills the unused area so stack_max_used() can find the
+*         deepest point reached, and stack_check() can be called from places
+*         expected to be deep (like nested interrupts) to sample it directly.
+*
+* @author Alvaro Prieto
+*/
+#include "stack.h"
+
+extern uint8_t _end;
+extern uint8_t __stack;
+
+// Deepest stack use seen by stack_check(), in bytes
+static volatile uint16_t stack_max_checked = 0;
+
+/*******************************************************************************
+ * @fn     uint16_t read_sp( void )
+ * @brief  Current stack pointer
+ * ****************************************************************************/
+static inline uint16_t read_sp( void )
+{
+  uint16_t sp;
+  
+  __asm__ __volatile__ ( "mov r1, %0" : "=r" (sp) );
+  
+  return sp;
+}
+
+/*******************************************************************************
+ * @fn     void stack_paint( void )
+ * @brief  Fill the unused stack with STACK_PAINT. Call early in main
+ * ****************************************************************************/
+void stack_paint( void )
+{
+  uint8_t* address;
+  uint16_t limit;
+  
+  // Leave some room for this function's own frame
+  limit = read_sp() - 16;
+  
+  for( address = &_end; (uint16_t)address < limit; address++ )
+  {
+    *address = STACK_PAINT;
+  }
+}
+
+/*******************************************************************************
+ * @fn     uint16_t stack_free( void )
+ * @brief  Bytes left between the stack pointer and the static data
+ * ****************************************************************************/
+uint16_t stack_free( void )
+{
+  return read_sp() - (uint16_t)&_end;
+}
+
+/*******************************************************************************
+ * @fn     void stack_check( void )
+ * @brief  Record the current stack depth if it is the deepest seen so far
+ * ****************************************************************************/
+void stack_check( void )
+{
+  uint16_t used;
+  
+  used = (uint16_t)&__stack - read_sp();
+  
+  if( used > stack_max_checked )
+  {
+    stack_max_checked = used;
+  }
+}
+
+/*******************************************************************************
+ * @fn     uint16_t stack_max_used( void )
+ * @brief  Worst-case stack use in bytes, the larger of the deepest sample from
+ *         stack_check() and the deepest painted byte overwritten
+ * ****************************************************************************/
+uint16_t stack_max_used( void )
+{
+  uint8_t* address;
+  uint16_t used;
+  
+  address = &_end;
+  while( ( (uint16_t)address < read_sp() ) && ( STACK_PAINT == *address ) )
+  {
+    address++;
+  }
+  
+  used = (uint16_t)&__stack - (uint16_t)address;
+  
+  if( stack_max_checked > used )
+  {
+    used = stack_max_checked;
+  }
+  
+  return used;
+}
@@ -0,0 +1,19 @@
+/** @file stack.h
+*
+* @brief Stack usage measurement
+*
+* @author Alvaro Prieto
+*/
+#ifndef _STACK_H
+#define _STACK_H
+
+#include "common.h"
+
+#define STACK_PAINT (0xA5) // Fill pattern for unused stack
+
+void stack_paint( void );
+uint16_t stack_free( void );
+void stack_check( void );
+uint16_t stack_max_used( void );
+
+#endif /* _STACK_H */
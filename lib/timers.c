@@ -5,6 +5,7 @@
 * @author Alvaro Prieto
 */
 #include "timers.h"
+#include "stack.h"
 #include <signal.h>
 
 
@@ -14,6 +15,15 @@ static uint8_t dummy_callback( void );
 static uint8_t (*ccr_callbacks[TOTAL_CCRS + 1])( void ) ;
 static uint8_t timer_mode;
 
+// Only this CCR interrupt may preempt ISRs that allow preemption
+static uint8_t preemptive_ccr = NO_PREEMPTION;
+static volatile uint8_t preempted = 0;
+
+// Other interrupt enables cleared while an ISR is preempted
+static uint16_t masked_adc12ie;
+static uint16_t masked_rf1aie;
+static uint8_t masked_uca0ie;
+
 /*******************************************************************************
  * @fn     void setup_timer_a( uint8_t mode )
  * @brief  Initialize callback functions and start timer in up mode
@@ -180,6 +190,223 @@ void increment_ccr( uint8_t ccr_index, uint16_t value )
   }
 }
 
+/*******************************************************************************
+ * @fn     uint16_t timer_now( void )
+ * @brief  Current timer count
+ * ****************************************************************************/
+uint16_t timer_now( void )
+{
+  uint16_t count;
+  
+  // Timer runs from ACLK, asynchronous to the CPU. Read until two agree
+  do
+  {
+    count = TA0R;
+  } while( count != TA0R );
+  
+  return count;
+}
+
+/*******************************************************************************
+ * @fn     void setup_capture( uint8_t ccr_index )
+ * @brief  Use CCR[ccr_index] to capture the timer on rising edges of its 
+ *         CCIxB input, synchronized to the timer clock and without an 
+ *         interrupt. Only CCR3 (radio GDO1) and CCR4 (radio GDO2) are
+ *         supported. Its callback is never called
+ * ****************************************************************************/
+void setup_capture( uint8_t ccr_index )
+{
+  switch (ccr_index)
+  {
+    case (3):
+    {
+      TA0CCTL3 = CM_1 + CCIS_1 + SCS + CAP;
+      break;
+    }
+    case (4):
+    {
+      TA0CCTL4 = CM_1 + CCIS_1 + SCS + CAP;
+      break;
+    }
+    default:
+    {
+      //Shouldn't happen...  
+      break;  
+    }
+  }
+}
+
+/*******************************************************************************
+ * @fn     uint8_t read_capture( uint8_t ccr_index, uint16_t* value )
+ * @brief  Copy the count captured by CCR[ccr_index] into [value]. Returns 1
+ *         if there was exactly one capture since the last call, 0 if there 
+ *         was none or it was overwritten
+ * ****************************************************************************/
+uint8_t read_capture( uint8_t ccr_index, uint16_t* value )
+{
+  uint16_t control;
+  
+  switch (ccr_index)
+  {
+    case (3):
+    {
+      control = TA0CCTL3;
+      *value = TA0CCR3;
+      TA0CCTL3 &= ~( CCIFG + COV );
+      break;
+    }
+    case (4):
+    {
+      control = TA0CCTL4;
+      *value = TA0CCR4;
+      TA0CCTL4 &= ~( CCIFG + COV );
+      break;
+    }
+    default:
+    {
+      return 0;
+    }
+  }
+  
+  return ( ( control & ( CCIFG + COV ) ) == CCIFG );
+}
+
+/*******************************************************************************
+ * @fn     set_preemptive_ccr( uint8_t ccr_index )
+ * @brief  Let CCR[ccr_index] interrupts preempt ISRs that call
+ *         timer_allow_preemption(). Its callback runs with interrupts 
+ *         disabled, so it must be short and must not touch what the 
+ *         preempted ISR is using. NO_PREEMPTION turns it off, with 
+ *         PREEMPTION_OTHER_TIMER the sample timer (Timer1_A CCR0) is the 
+ *         only interrupt that can get in
+ * ****************************************************************************/
+void set_preemptive_ccr( uint8_t ccr_index )
+{
+  preemptive_ccr = ccr_index;
+}
+
+/*******************************************************************************
+ * @fn     uint16_t timer_allow_preemption( void )
+ * @brief  Called from an ISR (after acknowledging its own interrupt source) to
+ *         let the preemptive CCR interrupt in. Every other interrupt (timers,
+ *         ADC, radio and UART) is masked and interrupts are enabled, so no 
+ *         other ISR can run in the middle of the preempted one. Denied if 
+ *         there is no preemptive CCR, an ISR is already preempted or the 
+ *         stack is running low. Returns the masked timer interrupts for 
+ *         timer_end_preemption()
+ * ****************************************************************************/
+uint16_t timer_allow_preemption( void )
+{
+  uint16_t masked = 0;
+  
+  if( ( NO_PREEMPTION == preemptive_ccr ) || preempted || 
+      ( stack_free() < PREEMPTION_STACK_RESERVE ) )
+  {
+    return PREEMPTION_DENIED;
+  }
+  
+  preempted = 1;
+  stack_check();
+  
+  if( ( 0 != preemptive_ccr ) && ( TA0CCTL0 & CCIE ) )
+  {
+    TA0CCTL0 &= ~CCIE;
+    masked |= BIT0;
+  }
+  if( ( 1 != preemptive_ccr ) && ( TA0CCTL1 & CCIE ) )
+  {
+    TA0CCTL1 &= ~CCIE;
+    masked |= BIT1;
+  }
+  if( ( 2 != preemptive_ccr ) && ( TA0CCTL2 & CCIE ) )
+  {
+    TA0CCTL2 &= ~CCIE;
+    masked |= BIT2;
+  }
+  if( ( 3 != preemptive_ccr ) && ( TA0CCTL3 & CCIE ) )
+  {
+    TA0CCTL3 &= ~CCIE;
+    masked |= BIT3;
+  }
+  if( ( 4 != preemptive_ccr ) && ( TA0CCTL4 & CCIE ) )
+  {
+    TA0CCTL4 &= ~CCIE;
+    masked |= BIT4;
+  }
+  if( TA0CTL & TAIE )
+  {
+    TA0CTL &= ~TAIE;
+    masked |= BIT5;
+  }
+  if( ( PREEMPTION_OTHER_TIMER != preemptive_ccr ) && ( TA1CCTL0 & CCIE ) )
+  {
+    TA1CCTL0 &= ~CCIE;
+    masked |= BIT6;
+  }
+  
+  masked_adc12ie = ADC12IE;
+  ADC12IE = 0;
+  masked_rf1aie = RF1AIE;
+  RF1AIE = 0;
+  masked_uca0ie = UCA0IE;
+  UCA0IE = 0;
+  
+  eint();
+  
+  return masked;
+}
+
+/*******************************************************************************
+ * @fn     void timer_end_preemption( uint16_t masked )
+ * @brief  Disable interrupts again and unmask the timer interrupts masked by
+ *         timer_allow_preemption(). Anything that came in meanwhile is still
+ *         pending and runs once the ISR returns
+ * ****************************************************************************/
+void timer_end_preemption( uint16_t masked )
+{
+  if( PREEMPTION_DENIED == masked )
+  {
+    return;
+  }
+  
+  dint();
+  
+  if( masked & BIT0 )
+  {
+    TA0CCTL0 |= CCIE;
+  }
+  if( masked & BIT1 )
+  {
+    TA0CCTL1 |= CCIE;
+  }
+  if( masked & BIT2 )
+  {
+    TA0CCTL2 |= CCIE;
+  }
+  if( masked & BIT3 )
+  {
+    TA0CCTL3 |= CCIE;
+  }
+  if( masked & BIT4 )
+  {
+    TA0CCTL4 |= CCIE;
+  }
+  if( masked & BIT5 )
+  {
+    TA0CTL |= TAIE;
+  }
+  if( masked & BIT6 )
+  {
+    TA1CCTL0 |= CCIE;
+  }
+  
+  ADC12IE |= masked_adc12ie;
+  RF1AIE |= masked_rf1aie;
+  UCA0IE |= masked_uca0ie;
+  
+  preempted = 0;
+}
+
 /*******************************************************************************
  * @fn     void dummy_callback( void )
  * @brief  empty function works as default callback
@@ -189,6 +416,18 @@ inline void clear_timer()
   TA0CTL = TASSEL__ACLK + MC_1 + TAIE + TACLR;
 }
 
+/*******************************************************************************
+ * @fn     void set_timer( uint16_t count )
+ * @brief  Restart the timer from [count] instead of 0
+ * ****************************************************************************/
+void set_timer( uint16_t count )
+{
+  // ACLK is asynchronous to the CPU, only write the count while stopped
+  TA0CTL = TASSEL__ACLK + MC_0 + TAIE + TACLR;
+  TA0R = count;
+  TA0CTL |= MC_1;
+}
+
 /*******************************************************************************
  * @fn     void dummy_callback( void )
  * @brief  empty function works as default callback
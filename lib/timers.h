@@ -16,11 +16,25 @@
 #define MODE_CONTINUOUS MC_2
 #define MODE_UPDOWN MC_3
 
+#define NO_PREEMPTION (0xFF) // No timer interrupt may preempt other ISRs
+#define PREEMPTION_OTHER_TIMER (0xFE) // Only the sample timer (Timer1_A) may
+#define PREEMPTION_DENIED (0xFFFF) // timer_allow_preemption() didn't enable it
+
+// Bytes of free stack needed before an ISR may be preempted
+#define PREEMPTION_STACK_RESERVE (64)
+
 void setup_timer_a( uint8_t );
 void register_timer_callback( uint8_t (*)(void), uint8_t);
 void set_ccr( uint8_t, uint16_t );
 void clear_ccr( uint8_t );
 void increment_ccr( uint8_t, uint16_t );
 inline void clear_timer();
+void set_timer( uint16_t );
+uint16_t timer_now( void );
+void setup_capture( uint8_t );
+uint8_t read_capture( uint8_t, uint16_t* );
+void set_preemptive_ccr( uint8_t );
+uint16_t timer_allow_preemption( void );
+void timer_end_preemption( uint16_t );
 #endif /* _TIMERS_H */\
 
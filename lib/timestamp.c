@@ -0,0 +1,123 @@
+/** @file timestamp.c
+*
+* @brief Sub-tick timestamps against TA0. TA0 counts ACLK ticks (30.5us), 
+*         too coarse to line up devices closely. Radio sync words are 
+*         captured by TA0 (GDO1, see read_capture()), which gives the tick. 
+*         While running, TA1 counts SMCLK and captures the same sync word 
+*         (GDO0 on CCI0B) and every falling ACLK edge (CCI2B). How far past
+*         the last ACLK edge the sync word came, measured in SMCLK counts 
+*         against the SMCLK counts per tick, is the fraction. Both are 
+*         captured by the hardware, so it doesn't matter how long it takes
+*         to get to timestamp_fraction().
+*
+*         TA0 latches synchronized captures on falling ACLK edges, so a 
+*         capture of n means the event came between the middle of tick n-1 
+*         and the middle of tick n. The fraction is counted from that first
+*         falling edge, so n plus the fraction is half a tick late. 
+*         TIMESTAMP_FRACTION / 2 (what is returned when there's no fine 
+*         timestamp) is the same half tick for a plain capture, so the two 
+*         can be mixed.
+*
+*         SMCLK has to keep running while TA1 does, so this only suits 
+*         devices that sleep no deeper than LPM0 and don't use TA1 
+*         themselves (end devices sample with it).
+*
+* @author Alvaro Prieto
+*/
+#include "timestamp.h"
+
+// SMCLK counts in TIMESTAMP_CALIBRATION_TICKS ACLK ticks
+static uint16_t calibration_counts = 1;
+
+/*******************************************************************************
+ * @fn     void timestamp_start( void )
+ * @brief  Start TA1 from SMCLK, capturing sync words and ACLK edges, and 
+ *         measure SMCLK against ACLK. Busy waits for 
+ *         TIMESTAMP_CALIBRATION_TICKS + 1 ticks. SMCLK is locked to ACLK by 
+ *         the FLL, so once is enough while it keeps running
+ * ****************************************************************************/
+void timestamp_start( void )
+{
+  uint16_t first;
+  uint8_t edges;
+  
+  TA1CTL = TASSEL_2 + MC_2 + TACLR; // SMCLK, continuous mode
+  TA1CCTL0 = CM_1 + CCIS_1 + SCS + CAP; // Radio GDO0 (sync word) rising
+  TA1CCTL2 = CM_2 + CCIS_1 + SCS + CAP; // ACLK falling
+  
+  // Time TIMESTAMP_CALIBRATION_TICKS whole ticks between ACLK edge captures
+  while( !( TA1CCTL2 & CCIFG ) );
+  first = TA1CCR2;
+  TA1CCTL2 &= ~( CCIFG + COV );
+  
+  for( edges = 0; edges < TIMESTAMP_CALIBRATION_TICKS; edges++ )
+  {
+    while( !( TA1CCTL2 & CCIFG ) );
+    TA1CCTL2 &= ~( CCIFG + COV );
+  }
+  
+  calibration_counts = TA1CCR2 - first;
+  if( 0 == calibration_counts )
+  {
+    calibration_counts = 1;
+  }
+  
+  timestamp_discard();
+}
+
+/*******************************************************************************
+ * @fn     void timestamp_stop( void )
+ * @brief  Stop TA1
+ * ****************************************************************************/
+void timestamp_stop( void )
+{
+  TA1CTL = 0;
+  TA1CCTL0 = 0;
+  TA1CCTL2 = 0;
+}
+
+/*******************************************************************************
+ * @fn     void timestamp_discard( void )
+ * @brief  Throw away a sync word capture that was never read, so the next
+ *         timestamp_fraction() only sees a new one
+ * ****************************************************************************/
+void timestamp_discard( void )
+{
+  TA1CCTL0 &= ~( CCIFG + COV );
+}
+
+/*******************************************************************************
+ * @fn     uint8_t timestamp_fraction( void )
+ * @brief  How far past the middle of the tick before the one TA0 captured 
+ *         the sync word just sent or received was, in 1/TIMESTAMP_FRACTION
+ *         ticks. TIMESTAMP_FRACTION / 2 if the capture is missing or was 
+ *         overwritten. Has to be called within ~2ms of the sync word, before
+ *         the 16 bit difference between the captures wraps
+ * ****************************************************************************/
+uint8_t timestamp_fraction( void )
+{
+  uint16_t control;
+  uint16_t event;
+  int32_t since_edge;
+  
+  control = TA1CCTL0;
+  event = TA1CCR0;
+  TA1CCTL0 &= ~( CCIFG + COV );
+  
+  if( ( control & ( CCIFG + COV ) ) != CCIFG )
+  {
+    return TIMESTAMP_FRACTION / 2;
+  }
+  
+  // The latest edge capture may be from before or after the sync word, 
+  // they are all a whole number of ticks apart
+  since_edge = (int32_t)(int16_t)( event - TA1CCR2 ) * 
+                                    TIMESTAMP_CALIBRATION_TICKS;
+  since_edge %= calibration_counts;
+  if( since_edge < 0 )
+  {
+    since_edge += calibration_counts;
+  }
+  
+  return (uint8_t)( ( since_edge * TIMESTAMP_FRACTION ) / calibration_counts );
+}
@@ -0,0 +1,22 @@
+/** @file timestamp.h
+*
+* @brief Sub-tick timestamps against TA0, measured with TA1
+*
+* @author Alvaro Prieto
+*/
+#ifndef _TIMESTAMP_H
+#define _TIMESTAMP_H
+
+#include "common.h"
+
+#define TIMESTAMP_FRACTION (256) // Timestamp fraction units per ACLK tick
+
+// ACLK ticks timestamp_start() measures SMCLK over
+#define TIMESTAMP_CALIBRATION_TICKS (8)
+
+void timestamp_start( void );
+void timestamp_stop( void );
+void timestamp_discard( void );
+uint8_t timestamp_fraction( void );
+
+#endif /* _TIMESTAMP_H */
@@ -6,6 +6,14 @@
 */
 #include "uart.h"
 
+static uint8_t dummy_callback( uint8_t );
+
+// Called with every received character
+static uint8_t (*rx_callback)( uint8_t ) = dummy_callback;
+
+// Frame format used by uart_write_frame()
+static volatile uint8_t framing = UART_FRAMING_ESCAPED;
+
 /*******************************************************************************
  * @fn     void setup_uart( void )
  * @brief  configure uart for 115200BAUD on ports 1.6 and 1.7
@@ -30,6 +38,16 @@ void setup_uart( void )
   UCA0IE |= UCRXIE;                         // Enable USCI_A0 RX interrupt
 }
 
+/*******************************************************************************
+ * @fn     void register_uart_rx_callback( uint8_t (*callback)(uint8_t) )
+ * @brief  Register function called (from the ISR) with every received 
+ *         character. If it returns 1, the CPU wakes up after the interrupt
+ * ****************************************************************************/
+void register_uart_rx_callback( uint8_t (*callback)(uint8_t) )
+{
+  rx_callback = callback;
+}
+
 /*******************************************************************************
  * @fn     uart_put_char( uint8_t character )
  * @brief  transmit single character
@@ -80,6 +98,95 @@ void uart_write_escaped( uint8_t* buffer, uint16_t length )
   uart_put_char( 0x7e );
 }
 
+/*******************************************************************************
+ * @fn     uart_write_cobs( uint8_t* buffer, uint16_t length )
+ * @brief  transmit whole buffer COBS encoded, followed by a 0x00 delimiter.
+ *         Adds at most one byte for every 254, whatever the contents
+ * ****************************************************************************/
+void uart_write_cobs( uint8_t* buffer, uint16_t length )
+{
+  uint16_t start = 0;
+  uint16_t end;
+  uint8_t code;
+  
+  for(;;)
+  {
+    // Run of up to 254 non-zero bytes
+    end = start;
+    while( ( end < length ) && ( buffer[end] != 0x00 ) && 
+            ( ( end - start ) < 254 ) )
+    {
+      end++;
+    }
+    
+    code = (uint8_t)( end - start + 1 );
+    uart_put_char( code );
+    for( ; start < end; start++ )
+    {
+      uart_put_char( buffer[start] );
+    }
+    
+    if( end == length )
+    {
+      break;
+    }
+    
+    // The zero that ended the run is implied by the code (unless it was full)
+    if( code != 0xFF )
+    {
+      start++;
+    }
+  }
+  
+  uart_put_char( 0x00 );
+}
+
+/*******************************************************************************
+ * @fn     uint8_t uart_set_framing( uint8_t new_framing )
+ * @brief  Select the frame format used by uart_write_frame(), 
+ *         UART_FRAMING_ESCAPED (default) or UART_FRAMING_COBS. Returns 0 and
+ *         keeps the current one if [new_framing] is neither
+ * ****************************************************************************/
+uint8_t uart_set_framing( uint8_t new_framing )
+{
+  if( ( UART_FRAMING_ESCAPED != new_framing ) && 
+      ( UART_FRAMING_COBS != new_framing ) )
+  {
+    return 0;
+  }
+  
+  framing = new_framing;
+  
+  return 1;
+}
+
+/*******************************************************************************
+ * @fn     uart_write_frame( uint8_t* buffer, uint16_t length )
+ * @brief  transmit whole buffer as one frame, in the selected format
+ * ****************************************************************************/
+void uart_write_frame( uint8_t* buffer, uint16_t length )
+{
+  if( UART_FRAMING_COBS == framing )
+  {
+    uart_write_cobs( buffer, length );
+  }
+  else
+  {
+    uart_write_escaped( buffer, length );
+  }
+}
+
+/*******************************************************************************
+ * @fn     uint8_t dummy_callback( uint8_t character )
+ * @brief  empty function works as default callback
+ * ****************************************************************************/
+static uint8_t dummy_callback( uint8_t character )
+{
+  __no_operation();
+
+  return 0;
+}
+
 /*******************************************************************************
  * @fn     void uart_isr( void )
  * @brief  UART ISR
@@ -96,6 +203,10 @@ wakeup interrupt ( USCI_A0_VECTOR ) uart_isr(void) // CHANGE
     }
     case 2:	// Vector 2 - RXIFG
     {
+      if( rx_callback( UCA0RXBUF ) )
+      {
+        __bic_SR_register_on_exit(LPM3_bits);
+      }
 
       //while (!(UCA0IFG&UCTXIFG));	// USCI_A0 TX buffer ready?
       //UCA0TXBUF = UCA0RXBUF;		// TX -> RXed character
@@ -10,13 +10,25 @@
 #include "common.h"
 #include <signal.h>
 
+// Frame formats used by uart_write_frame()
+#define UART_FRAMING_ESCAPED (0) // 0x7E flags, 0x7E/0x7D escaped with 0x7D
+#define UART_FRAMING_COBS (1) // COBS encoded, ends with 0x00
+
 void setup_uart( void );
 
+void register_uart_rx_callback( uint8_t (*)(uint8_t) );
+
 void uart_put_char( uint8_t );
 
 void uart_write( uint8_t*, uint16_t );
 
 void uart_write_escaped( uint8_t*, uint16_t );
 
+void uart_write_cobs( uint8_t*, uint16_t );
+
+uint8_t uart_set_framing( uint8_t );
+
+void uart_write_frame( uint8_t*, uint16_t );
+
 #endif /* _UART_H */\
 